@@ -0,0 +1,715 @@
+// Load generator for the 16-1 server.
+//
+// gcc 16-1-load.c -lpthread -o load
+// ./load 8080 --connections 256 --threads 4 --keep-alive --duration 10
+// ./load 8080 --mix 4k:90,256k:9,4m:1 --directory /path/to/directory
+//
+// Every thread drives its share of the connections with its own epoll set:
+// a connection sends one request, reads the response up to Content-Length
+// and then sends the next one (--keep-alive) or reconnects. The requested
+// files are picked at random by weight from the size mix; with --directory
+// the files "load-<SIZE>" are created there first, otherwise they must
+// already exist in the served directory.
+//
+// The latency of a request is measured from the moment it is written (or
+// the connection is started, without keep-alive) to its last body byte
+// and recorded in a per-thread log-linear histogram in the spirit of
+// HdrHistogram: 64 sub-buckets per power of two keep every recorded value
+// within 1.6%. The histograms are merged once the threads are done.
+//
+// This is a closed loop: a slow response delays the next request of its
+// connection, so the percentiles describe the server under exactly
+// --connections outstanding requests.
+
+#define _GNU_SOURCE // memmem
+
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECK_OR_EXIT(WHAT_TO_CHECK, ERROR) \
+    if (WHAT_TO_CHECK == -1) {              \
+        perror(#ERROR);                     \
+        exit(errno);                        \
+    }
+
+static const int kMaxEventsToRead = 64;
+static const int kMaxThreads = 1024;
+// bytes read from a socket at once, the body is counted and dropped
+static const size_t kReadSize = 256 * 1024;
+// chunk used to fill the generated files
+static const size_t kFillSize = 64 * 1024;
+
+#define kMaxMixEntries 16
+#define kResponseHeaderCapacity 4096
+#define kRequestCapacity 512
+
+// Histogram: values below 2 * kSubBuckets are exact, every further power of
+// two is split into kSubBuckets equal buckets.
+#define kSubBucketBits 6
+#define kSubBuckets (1 << kSubBucketBits)
+#define kHistogramSize ((64 - kSubBucketBits + 1) * kSubBuckets)
+
+struct histogram {
+    uint64_t counts[kHistogramSize];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+struct mix_entry {
+    off_t size;
+    int weight;
+    // "/load-4k"
+    char path[64];
+};
+
+struct load_options {
+    const char* host;
+    int port_number;
+    int connections;
+    int threads;
+    int keep_alive;
+    // stop after this many requests, or after duration seconds if it is set
+    long long requests;
+    double duration;
+    const char* directory;
+    struct mix_entry mix[kMaxMixEntries];
+    int mix_count;
+    int total_weight;
+};
+
+static struct load_options options = {
+    .host = "127.0.0.1",
+    .connections = 64,
+    .threads = 1,
+    .requests = 100000,
+};
+
+enum connection_state {
+    kConnecting,
+    kWritingRequest,
+    kReadingHeader,
+    kReadingBody,
+};
+
+struct load_connection {
+    int fd;
+    enum connection_state state;
+    char request[kRequestCapacity];
+    size_t request_size;
+    size_t request_sent;
+    char header[kResponseHeaderCapacity];
+    size_t header_size;
+    off_t body_left;
+    // start of the request being served, nanoseconds
+    uint64_t started;
+};
+
+struct load_thread {
+    pthread_t thread;
+    int epoll_fd;
+    struct load_connection* connections;
+    int connections_count;
+    int open_connections;
+    uint64_t random_state;
+    char* read_buffer;
+
+    struct histogram latency;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bytes_received;
+};
+
+static struct sockaddr_in server_address;
+// requests started so far by all threads
+static long long requests_started = 0;
+static uint64_t deadline = 0;
+
+uint64_t now_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int histogram_index(const uint64_t value) {
+    if (value < 2 * kSubBuckets) {
+        return value;
+    }
+    const int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets;
+}
+
+// The largest value that falls into the bucket.
+uint64_t histogram_highest_value(const int index) {
+    if (index < 2 * kSubBuckets) {
+        return index;
+    }
+    const int shift = index / kSubBuckets - 1;
+    const uint64_t lowest = (uint64_t)(index - shift * kSubBuckets) << shift;
+    return lowest + (1ull << shift) - 1;
+}
+
+void histogram_record(struct histogram* histogram, const uint64_t value) {
+    ++histogram->counts[histogram_index(value)];
+    if (histogram->total == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    ++histogram->total;
+}
+
+void histogram_merge(struct histogram* to, const struct histogram* from) {
+    if (from->total == 0) {
+        return;
+    }
+    for (int i = 0; i < kHistogramSize; ++i) {
+        to->counts[i] += from->counts[i];
+    }
+    if (to->total == 0 || from->min < to->min) {
+        to->min = from->min;
+    }
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+    to->total += from->total;
+}
+
+// The value below which the given fraction of the recorded values lies.
+uint64_t histogram_percentile(const struct histogram* histogram,
+                              const double fraction) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramSize; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            const uint64_t value = histogram_highest_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// xorshift64*, one state per thread
+uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+const struct mix_entry* pick_file(struct load_thread* thread) {
+    int ticket = next_random(&thread->random_state) % options.total_weight;
+    for (int i = 0; i < options.mix_count; ++i) {
+        ticket -= options.mix[i].weight;
+        if (ticket < 0) {
+            return &options.mix[i];
+        }
+    }
+    return &options.mix[options.mix_count - 1];
+}
+
+// Claims the next request of the run. Returns 0 when the run is over.
+int start_request() {
+    if (deadline) {
+        return now_nanoseconds() < deadline;
+    }
+    return __atomic_fetch_add(&requests_started, 1, __ATOMIC_RELAXED) < options.requests;
+}
+
+void prepare_request(struct load_thread* thread, struct load_connection* connection) {
+    const struct mix_entry* file = pick_file(thread);
+    connection->request_size = snprintf(
+        connection->request, sizeof(connection->request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+        file->path, options.host, options.keep_alive ? "keep-alive" : "close");
+    connection->request_sent = 0;
+    connection->header_size = 0;
+    connection->started = now_nanoseconds();
+}
+
+void set_events(struct load_thread* thread, struct load_connection* connection,
+                const uint32_t events) {
+    struct epoll_event event = {
+        .events = events,
+        .data.ptr = connection
+    };
+    CHECK_OR_EXIT(epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event),
+                  "epoll_ctl");
+}
+
+// Starts a new connection with a new request, or leaves the slot empty
+// when the run is over.
+void open_connection(struct load_thread* thread, struct load_connection* connection) {
+    connection->fd = -1;
+    if (!start_request()) {
+        return;
+    }
+    connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    CHECK_OR_EXIT(connection->fd, "socket");
+    const int one = 1;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    prepare_request(thread, connection);
+    connection->state = kConnecting;
+    if (connect(connection->fd, (struct sockaddr*)&server_address,
+                sizeof(server_address)) == 0) {
+        connection->state = kWritingRequest;
+    } else if (errno != EINPROGRESS) {
+        perror("connect");
+        exit(errno);
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLOUT,
+        .data.ptr = connection
+    };
+    CHECK_OR_EXIT(epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event),
+                  "epoll_ctl");
+    ++thread->open_connections;
+}
+
+void close_load_connection(struct load_thread* thread,
+                           struct load_connection* connection) {
+    close(connection->fd);
+    connection->fd = -1;
+    --thread->open_connections;
+}
+
+void fail_connection(struct load_thread* thread, struct load_connection* connection) {
+    ++thread->errors;
+    close_load_connection(thread, connection);
+    open_connection(thread, connection);
+}
+
+// The response is complete: records it and goes on with the next request.
+void complete_request(struct load_thread* thread, struct load_connection* connection) {
+    histogram_record(&thread->latency, now_nanoseconds() - connection->started);
+    ++thread->completed;
+
+    if (!options.keep_alive) {
+        close_load_connection(thread, connection);
+        open_connection(thread, connection);
+        return;
+    }
+    if (!start_request()) {
+        close_load_connection(thread, connection);
+        return;
+    }
+    prepare_request(thread, connection);
+    connection->state = kWritingRequest;
+}
+
+// Parses the status line and Content-Length. Returns -1 on a malformed
+// response or an unexpected status.
+int parse_response_header(struct load_connection* connection) {
+    int status = 0;
+    if (sscanf(connection->header, "HTTP/1.%*d %d", &status) != 1 ||
+        (status != 200 && status != 206 && status != 304)) {
+        return -1;
+    }
+    connection->body_left = 0;
+    const char* line = connection->header;
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            connection->body_left = strtoll(line + 15, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// Returns 1 when the response is complete, 0 when more bytes are needed
+// and -1 on error.
+int read_response(struct load_thread* thread, struct load_connection* connection) {
+    while (1) {
+        const ssize_t received = read(connection->fd, thread->read_buffer, kReadSize);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        thread->bytes_received += received;
+
+        const char* data = thread->read_buffer;
+        size_t size = received;
+        if (connection->state == kReadingHeader) {
+            const size_t room = sizeof(connection->header) - 1 - connection->header_size;
+            const size_t copied = size < room ? size : room;
+            memcpy(connection->header + connection->header_size, data, copied);
+            const size_t scanned = connection->header_size > 3 ? connection->header_size - 3 : 0;
+            connection->header_size += copied;
+            connection->header[connection->header_size] = '\0';
+
+            const char* end = memmem(connection->header + scanned,
+                                     connection->header_size - scanned, "\r\n\r\n", 4);
+            if (end == NULL) {
+                if (copied == room) {
+                    return -1;
+                }
+                continue;
+            }
+            const size_t header_size = end + 4 - connection->header;
+            connection->header[header_size - 2] = '\0';
+            if (parse_response_header(connection) == -1) {
+                return -1;
+            }
+            // the rest of this read is already body
+            const size_t consumed = header_size - (connection->header_size - copied);
+            data += consumed;
+            size -= consumed;
+            connection->state = kReadingBody;
+        }
+
+        if ((off_t)size > connection->body_left) {
+            // we never pipeline, nothing may follow the body
+            return -1;
+        }
+        connection->body_left -= size;
+        if (connection->body_left == 0) {
+            return 1;
+        }
+    }
+}
+
+// Returns 1 when the request is fully written, 0 when the socket is full
+// and -1 on error.
+int write_request(struct load_connection* connection) {
+    while (connection->request_sent < connection->request_size) {
+        const ssize_t written = send(
+            connection->fd, connection->request + connection->request_sent,
+            connection->request_size - connection->request_sent, MSG_NOSIGNAL);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->request_sent += written;
+    }
+    return 1;
+}
+
+void handle_connection(struct load_thread* thread, struct load_connection* connection,
+                       const uint32_t events) {
+    if (connection->state == kConnecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (events & (EPOLLERR | EPOLLHUP))) {
+            fail_connection(thread, connection);
+            return;
+        }
+        connection->state = kWritingRequest;
+    }
+
+    while (connection->fd != -1) {
+        if (connection->state == kWritingRequest) {
+            const int result = write_request(connection);
+            if (result == -1) {
+                fail_connection(thread, connection);
+                return;
+            }
+            if (result == 0) {
+                set_events(thread, connection, EPOLLOUT);
+                return;
+            }
+            connection->state = kReadingHeader;
+        }
+
+        const int result = read_response(thread, connection);
+        if (result == -1) {
+            fail_connection(thread, connection);
+            return;
+        }
+        if (result == 0) {
+            set_events(thread, connection, EPOLLIN);
+            return;
+        }
+        const int reused = options.keep_alive;
+        complete_request(thread, connection);
+        if (!reused) {
+            // a fresh connection waits for its connect to complete
+            return;
+        }
+    }
+}
+
+void* thread_routine(void* argument) {
+    struct load_thread* thread = argument;
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    CHECK_OR_EXIT(thread->epoll_fd, "epoll_create1");
+    thread->read_buffer = malloc(kReadSize);
+    assert(thread->read_buffer != NULL);
+
+    for (int i = 0; i < thread->connections_count; ++i) {
+        open_connection(thread, &thread->connections[i]);
+    }
+
+    struct epoll_event events[kMaxEventsToRead];
+    while (thread->open_connections > 0) {
+        const int events_count =
+            epoll_wait(thread->epoll_fd, events, kMaxEventsToRead, -1);
+        if (events_count == -1 && errno == EINTR) {
+            continue;
+        }
+        CHECK_OR_EXIT(events_count, "epoll_wait");
+        for (int i = 0; i < events_count; ++i) {
+            handle_connection(thread, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    free(thread->read_buffer);
+    close(thread->epoll_fd);
+    return NULL;
+}
+
+// "4k" -> 4096, the suffixes are k, m and g.
+off_t parse_size(const char* value, char** end) {
+    off_t size = strtoll(value, end, 10);
+    switch (**end) {
+    case 'g':
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'm':
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'k':
+    case 'K':
+        size *= 1024;
+        ++*end;
+        break;
+    }
+    return size;
+}
+
+// "4k:90,256k:9,4m:1"
+void parse_mix(const char* value) {
+    options.mix_count = 0;
+    options.total_weight = 0;
+    while (*value) {
+        assert(options.mix_count < kMaxMixEntries);
+        struct mix_entry* entry = &options.mix[options.mix_count++];
+        const char* size_begin = value;
+        char* end = NULL;
+        entry->size = parse_size(value, &end);
+        snprintf(entry->path, sizeof(entry->path), "/load-%.*s",
+                 (int)(end - size_begin), size_begin);
+        entry->weight = 1;
+        if (*end == ':') {
+            entry->weight = strtol(end + 1, &end, 10);
+        }
+        if (end == size_begin || entry->size < 0 || entry->weight <= 0 ||
+            (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "bad --mix entry: %s\n", size_begin);
+            exit(EXIT_FAILURE);
+        }
+        options.total_weight += entry->weight;
+        value = *end ? end + 1 : end;
+    }
+}
+
+// Creates the files of the mix in --directory unless they already have
+// the right size.
+void create_files() {
+    char* chunk = malloc(kFillSize);
+    assert(chunk != NULL);
+    for (size_t i = 0; i < kFillSize; ++i) {
+        chunk[i] = 'a' + i % 26;
+    }
+
+    for (int i = 0; i < options.mix_count; ++i) {
+        const struct mix_entry* entry = &options.mix[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", options.directory, entry->path);
+        struct stat stat_buffer;
+        if (stat(path, &stat_buffer) == 0 && stat_buffer.st_size == entry->size) {
+            continue;
+        }
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        CHECK_OR_EXIT(fd, "open");
+        for (off_t written = 0; written < entry->size;) {
+            const size_t count = entry->size - written < (off_t)kFillSize
+                                     ? (size_t)(entry->size - written) : kFillSize;
+            const ssize_t result = write(fd, chunk, count);
+            CHECK_OR_EXIT(result, "write");
+            written += result;
+        }
+        close(fd);
+    }
+    free(chunk);
+}
+
+void parse_options(int argc, char** argv) {
+    const struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"requests", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"mix", required_argument, NULL, 'm'},
+        {"directory", required_argument, NULL, 'D'},
+        {"host", required_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+
+    parse_mix("4k:90,256k:9,4m:1");
+    int option;
+    while ((option = getopt_long(argc, argv, "c:t:n:d:km:D:H:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            if (options.threads == 0) {
+                options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 'n':
+            options.requests = atoll(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'k':
+            options.keep_alive = 1;
+            break;
+        case 'm':
+            parse_mix(optarg);
+            break;
+        case 'D':
+            options.directory = optarg;
+            break;
+        case 'H':
+            options.host = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s PORT [--connections N] [--threads N] [--keep-alive]"
+                    " [--requests N | --duration SECONDS] [--mix SIZE:WEIGHT,...]"
+                    " [--directory DIRECTORY] [--host ADDRESS]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    assert(argc - optind == 1);
+    assert(options.threads > 0 && options.threads <= kMaxThreads);
+    assert(options.connections >= options.threads);
+    assert(options.requests > 0 && options.duration >= 0);
+    assert(options.mix_count > 0);
+
+    sscanf(argv[optind], "%d", &options.port_number);
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(options.port_number);
+    if (inet_pton(AF_INET, options.host, &server_address.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", options.host);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void print_report(const struct load_thread* threads, const double seconds) {
+    struct histogram* latency = calloc(1, sizeof(struct histogram));
+    assert(latency != NULL);
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_received = 0;
+    for (int i = 0; i < options.threads; ++i) {
+        histogram_merge(latency, &threads[i].latency);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        bytes_received += threads[i].bytes_received;
+    }
+
+    printf("%d connections, %d threads, %s\n", options.connections, options.threads,
+           options.keep_alive ? "keep-alive" : "connection per request");
+    printf("%llu requests, %llu errors in %.3f s\n", (unsigned long long)completed,
+           (unsigned long long)errors, seconds);
+    printf("%.0f req/s, %.1f MiB/s\n", completed / seconds,
+           bytes_received / seconds / (1024 * 1024));
+
+    const struct {
+        const char* name;
+        double fraction;
+    } percentiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999},
+    };
+    printf("latency, us: min %.1f", latency->min / 1e3);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        printf("  %s %.1f", percentiles[i].name,
+               histogram_percentile(latency, percentiles[i].fraction) / 1e3);
+    }
+    printf("  max %.1f\n", latency->max / 1e3);
+    free(latency);
+}
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+    if (options.directory) {
+        create_files();
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct load_connection* connections =
+        calloc(options.connections, sizeof(struct load_connection));
+    struct load_thread* threads = calloc(options.threads, sizeof(struct load_thread));
+    assert(connections != NULL && threads != NULL);
+
+    const uint64_t start = now_nanoseconds();
+    if (options.duration > 0) {
+        deadline = start + (uint64_t)(options.duration * 1e9);
+    }
+    // connections are split between the threads as evenly as possible
+    for (int i = 0, first = 0; i < options.threads; ++i) {
+        struct load_thread* thread = &threads[i];
+        thread->connections = connections + first;
+        thread->connections_count =
+            options.connections / options.threads + (i < options.connections % options.threads);
+        first += thread->connections_count;
+        thread->random_state = start ^ (0x9e3779b97f4a7c15ull * (i + 1));
+
+        const int error = pthread_create(&thread->thread, NULL, thread_routine, thread);
+        if (error) {
+            errno = error;
+            perror("pthread_create");
+            exit(errno);
+        }
+    }
+    for (int i = 0; i < options.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    print_report(threads, (now_nanoseconds() - start) / 1e9);
+    free(threads);
+    free(connections);
+    exit(EXIT_SUCCESS);
+}
@@ -23,20 +23,106 @@
 // 500,000 TCP connections from a single server is the gold standard these days.
 // The record is over a million.
 
+// gcc 16-1.c -lpthread -lz -o server
+// ./server 8080 /path/to/directory --workers 4
+// ./server 8080 /path/to/directory --keep-alive --backend io_uring
+// ./server 8080 /path/to/directory --keep-alive --benchmark 100000 --clients 64
+//
+// Every worker thread owns its own epoll instance and its own listening socket
+// bound to the same port with SO_REUSEPORT, so the kernel spreads incoming
+// connections between workers and no state is shared on the hot path.
+//
+// All client sockets are non-blocking. Each connection is a small state
+// machine: the request is accumulated in a growable buffer until the empty
+// line is found, then the response is written as far as the socket allows
+// and the rest is resumed on EPOLLOUT. A slow client therefore costs only
+// its own memory and never stalls the other connections of the worker.
+//
+// With --keep-alive the connection is kept open after the response unless
+// the client asks for "Connection: close" (or speaks HTTP/1.0 without
+// "Connection: keep-alive"). Pipelined requests are taken from the same
+// buffer one after another, so the responses go out in request order.
+// Connections without progress for --idle-timeout seconds are closed by
+// a periodic timerfd on the worker's epoll set.
+//
+// Every worker keeps a bounded LRU cache of open files keyed by the
+// normalized request path: the descriptor, the size and mtime and the
+// pre-rendered status line, Content-Length and validators. Directories of
+// cached files are watched with inotify, any change there drops the affected
+// entries. A cache hit costs one writev for the header and sendfile.
+//
+// Every file response carries Last-Modified and an ETag made of the mtime
+// and the size, both rendered once per cache entry. If-None-Match and
+// If-Modified-Since are answered with 304 and no body, a single
+// "Range: bytes=" range with 206 and only that part of the file (or 416 if
+// it starts past the end). Several ranges are answered with the whole file.
+//
+// With --gzip, text files (by extension) are sent gzip-encoded to clients
+// whose Accept-Encoding allows it. A "<file>.gz" sibling that is not older
+// than the file is sent as is; otherwise cached files up to 8 MiB are
+// compressed on the worker once and the result is kept with the entry, up
+// to --gzip-cache-size MiB per worker. Files that are not cached, or whose
+// compressed body does not fit the budget, are sent as they are rather than
+// compressed again on every request. Both carry "Vary: Accept-Encoding" and
+// an ETag of their own, Range and the conditionals apply to them as well.
+//
+// The header goes out with MSG_MORE when a body follows, so the kernel
+// puts it into the same segment as the first bytes of the file instead of
+// sending a tiny packet of its own. The body is sent by a resumable loop
+// that keeps the file offset in the connection, so files of any size are
+// sent completely. With --splice the body goes file -> pipe -> socket
+// through splice(2) instead of sendfile(2).
+//
+// Every worker counts responses by status, bytes sent, connections and
+// their errors, and times its accept4, read and sendfile/splice calls into
+// fixed histograms. Only the owning worker writes its counters (relaxed
+// atomic stores, no locked instructions), and GET /metrics (--metrics-path)
+// sums them over all workers in the Prometheus text format. A failing
+// connection is counted and closed, it never stops the server.
+//
+// --backend io_uring replaces the epoll loop with an io_uring one (when the
+// kernel headers have it): a multishot accept, receives into a ring of
+// provided buffers, a linked openat + statx pair on a cache miss and
+// linked splice pairs for the body. Requests are parsed and answered by the
+// same code as with epoll. --benchmark N serves the directory with each
+// backend in turn and fires N requests at it over loopback.
+
+#define _GNU_SOURCE // accept4, memmem, O_PATH, splice
+
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <signal.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/signalfd.h>
 #include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 #define CHECK_OR_EXIT(WHAT_TO_CHECK, ERROR) \
     if (WHAT_TO_CHECK == -1) {              \
@@ -44,15 +130,325 @@
         exit(errno);                        \
     }
 
-#define REAL_SIZE(STRING) sizeof(STRING) - 1
+// how many ready descriptors one epoll_wait call may return
+static const int kMaxEventsToRead = 64;
+static const int kSize = 4096;
+static const int kMaxWorkers = 1024;
+// a request whose headers do not fit is answered with 431
+static const size_t kMaxRequestSize = 64 * 1024;
+// upper bound of body bytes sent to one client per wakeup,
+// so a fast reader of a huge file does not starve the others
+static const size_t kMaxBytesPerTurn = 1024 * 1024;
+// requested capacity of a connection's splice pipe
+static const int kPipeSize = 1024 * 1024;
 
-#define WRITE_AND_CHECK(STRING, ERROR)                          \
-    const char result[] = STRING;                               \
-    CHECK_OR_EXIT(write(accept_fd, result, REAL_SIZE(result)),  \
-                ERROR);
+// text formats worth compressing, matched by the extension of the path
+static const char* const kCompressibleExtensions[] = {
+    "html", "htm", "css", "js", "mjs", "json", "xml", "svg", "txt", "csv", "md", "map",
+};
+// smaller files gain nothing from gzip, larger ones are too slow to compress
+// on the worker thread (a .gz sibling is served regardless of the size)
+static const off_t kMinCompressedFileSize = 256;
+static const off_t kMaxCompressedFileSize = 8 * 1024 * 1024;
+static const int kGzipLevel = 6;
 
-static const int kMaxEventsToRead = 1;
-static const int kSize = 4096;
+#define kHeaderCapacity 512
+// status line and entity headers, connection headers, in-memory body
+#define kResponseParts 3
+
+// response codes counted separately, anything else is counted as "other"
+static const int kStatusCodes[] = {200, 206, 304, 400, 403, 404, 416, 431, 500};
+#define kStatusCodesCount (sizeof(kStatusCodes) / sizeof(kStatusCodes[0]))
+
+// upper bounds of the syscall latency buckets, nanoseconds
+static const uint64_t kLatencyBounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+#define kLatencyBucketsCount (sizeof(kLatencyBounds) / sizeof(kLatencyBounds[0]))
+// "Thu, 01 Jan 1970 00:00:00 GMT"
+#define kHttpDateCapacity 32
+
+enum backend {
+    kEpollBackend,
+    kUringBackend,
+};
+
+struct server_options {
+    int port_number;
+    const char* path_to_directory;
+    // the served directory, opened once for openat
+    int directory_fd;
+    int workers_count;
+    int keep_alive;
+    int idle_timeout;
+    // open files cached by each worker, 0 disables the cache
+    int cache_capacity;
+    // send bodies with splice through a pipe instead of sendfile
+    int use_splice;
+    // negotiate gzip, keep up to gzip_cache_size bytes of compressed files
+    int gzip;
+    size_t gzip_cache_size;
+    // normalized like request paths: no leading slash, NULL disables it
+    const char* metrics_path;
+    enum backend backend;
+    // --benchmark: requests per backend and concurrent client connections
+    int benchmark_requests;
+    int benchmark_clients;
+};
+
+static struct server_options options = {
+    .workers_count = 1,
+    .keep_alive = 0,
+    .idle_timeout = 10,
+    .cache_capacity = 256,
+    .gzip_cache_size = 32 * 1024 * 1024,
+    .metrics_path = "metrics",
+    .backend = kEpollBackend,
+    .benchmark_clients = 16
+};
+
+// An open file ready to be sent. Connections hold a reference while they
+// send it, the cache holds one more while the entry is cached.
+struct file_entry {
+    // normalized path relative to the served directory
+    char* path;
+    size_t path_length;
+    uint64_t hash;
+
+    int fd;
+    off_t size;
+    time_t mtime;
+    // "HTTP/1.1 200 OK\r\nContent-Length: N\r\n" followed by the headers
+    // reused by 206 and 304: Content-Encoding and Vary (with --gzip),
+    // Last-Modified, ETag and Accept-Ranges
+    char header[kHeaderCapacity];
+    size_t header_size;
+    size_t validators_offset;
+    // quoted, as sent and as compared with If-None-Match
+    char etag[48];
+    size_t etag_length;
+
+    // body of a file compressed on demand, fd is -1 then
+    char* data;
+    // the entry is the gzip representation of the file at path
+    int gzip_encoded;
+    // --gzip: the file may be sent gzip-encoded, gzip is its representation
+    // once gzip_checked, NULL if there is none worth sending
+    int compressible;
+    int gzip_checked;
+    struct file_entry* gzip;
+
+    int references;
+    int cached;
+    struct file_entry* hash_next;
+    // most recently used entry is the head of the list
+    struct file_entry* lru_prev;
+    struct file_entry* lru_next;
+};
+
+struct file_cache {
+    struct file_entry** buckets;
+    size_t buckets_count;
+    struct file_entry* lru_head;
+    struct file_entry* lru_tail;
+    int size;
+
+    // bytes of data held by the gzip representations of cached entries
+    size_t compressed_size;
+
+    int inotify_fd;
+    // directory (relative to the served one) of every inotify watch
+    char** watched_directories;
+    int watched_directories_capacity;
+};
+
+enum error_stage {
+    kAcceptError,
+    // EPOLLERR or EPOLLHUP on the socket
+    kSocketError,
+    kReadError,
+    kWriteError,
+    kEpollError,
+    kMemoryError,
+    kErrorStagesCount,
+};
+
+static const char* const kErrorStageNames[] = {
+    "accept", "socket", "read", "write", "epoll", "memory",
+};
+
+enum timed_syscall {
+    kAcceptSyscall,
+    kReadSyscall,
+    kSendfileSyscall,
+    kSpliceSyscall,
+    kTimedSyscallsCount,
+};
+
+static const char* const kTimedSyscallNames[] = {
+    "accept4", "read", "sendfile", "splice",
+};
+
+struct latency_histogram {
+    // the last bucket is +Inf
+    uint64_t buckets[kLatencyBucketsCount + 1];
+    uint64_t sum;
+    uint64_t count;
+};
+
+// Written by the owning worker only, read by the /metrics handler of any.
+struct worker_metrics {
+    // kStatusCodes, then everything else
+    uint64_t responses[kStatusCodesCount + 1];
+    uint64_t bytes_sent;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t idle_timeouts;
+    uint64_t errors[kErrorStagesCount];
+    struct latency_histogram syscalls[kTimedSyscallsCount];
+};
+
+enum connection_state {
+    kReadingRequest,
+    kWritingHeader,
+    kWritingBody,
+};
+
+struct connection {
+    // must be the first member: epoll data.ptr points to it
+    int fd;
+    enum connection_state state;
+    // events currently registered in epoll
+    uint32_t events;
+
+    // request bytes received so far
+    char* buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    // the request being served starts at request_begin and ends at
+    // request_end, everything after it is pipelined requests
+    size_t request_begin;
+    size_t request_end;
+    // header fields of the request being served, after the request line
+    size_t headers_begin;
+    // prefix of buffer already known not to contain "\r\n\r\n"
+    size_t scanned;
+    // keep the connection open after the current response
+    int keep_alive;
+    // status code of the current response and bytes sent
+    // but not added to the worker's metrics yet
+    int status;
+    uint64_t bytes_sent;
+
+    // status line and entity headers, connection headers and the empty
+    // line, then an in-memory body; the parts are advanced as they are written
+    struct iovec response_parts[kResponseParts];
+    // storage of response_parts[0] for responses without a cached header
+    char header[kHeaderCapacity];
+    // generated body of the current response (metrics), freed with it
+    char* body;
+
+    struct file_entry* file;
+    off_t file_offset;
+    off_t file_end;
+    // --splice only: created on the first body, bytes are moved from the
+    // file into the pipe and from the pipe into the socket
+    int pipe_fds[2];
+    size_t bytes_in_pipe;
+
+#ifdef HAVE_IO_URING
+    // io_uring backend: submitted operations that have not completed yet,
+    // a closed connection is freed when the last of them completes
+    int pending_operations;
+    int closing;
+    // the body splice from the file failed, stop after the linked one
+    int body_failed;
+    struct msghdr message;
+    struct open_request* open_request;
+#endif
+
+    // the worker keeps connections ordered by last_activity,
+    // the least recently active one is the head of the list
+    time_t last_activity;
+    struct connection* prev;
+    struct connection* next;
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    int signal_fd;
+    int socket_fd;
+    int timer_fd;
+    struct file_cache cache;
+    // connections accepted by this worker and not closed yet
+    struct connection* connections;
+    struct connection* connections_tail;
+    int active_connections;
+    // monotonic seconds, updated once per epoll_wait
+    time_t now;
+#ifdef HAVE_IO_URING
+    struct uring* ring;
+    // closed connections still waiting for their operations to complete
+    int closing_connections;
+#endif
+    // set after SIGTERM/SIGINT: the listening socket is closed and
+    // the worker exits as soon as active_connections drops to zero
+    int stopping;
+    struct worker_metrics metrics;
+};
+
+// all workers, for the /metrics handler
+static struct worker* workers = NULL;
+static int workers_count = 0;
+
+// A counter has a single writer, a plain load and store is enough
+// as long as readers never see a torn value.
+void counter_add(uint64_t* counter, const uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+uint64_t counter_get(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t monotonic_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void record_latency(struct worker* worker, const enum timed_syscall syscall,
+                    const uint64_t started) {
+    const uint64_t latency = monotonic_nanoseconds() - started;
+    struct latency_histogram* histogram = &worker->metrics.syscalls[syscall];
+    size_t bucket = 0;
+    while (bucket < kLatencyBucketsCount && latency > kLatencyBounds[bucket]) {
+        ++bucket;
+    }
+    counter_add(&histogram->buckets[bucket], 1);
+    counter_add(&histogram->sum, latency);
+    counter_add(&histogram->count, 1);
+}
+
+void record_error(struct worker* worker, const enum error_stage stage) {
+    counter_add(&worker->metrics.errors[stage], 1);
+}
+
+void record_response(struct worker* worker, struct connection* connection) {
+    size_t index = 0;
+    while (index < kStatusCodesCount && kStatusCodes[index] != connection->status) {
+        ++index;
+    }
+    counter_add(&worker->metrics.responses[index], 1);
+}
+
+void flush_bytes_sent(struct worker* worker, struct connection* connection) {
+    counter_add(&worker->metrics.bytes_sent, connection->bytes_sent);
+    connection->bytes_sent = 0;
+}
 
 int make_epoll() {
     const int epoll_fd = epoll_create1(0);
@@ -70,6 +466,8 @@ sigset_t make_sigset() {
     return sigset;
 }
 
+// Must be called before any worker is started: threads inherit the signal
+// mask, so SIGTERM/SIGINT stay pending and are visible through the signalfd.
 int make_signal_fd() {
     const sigset_t sigset = make_sigset();
     sigprocmask(/* how = */ SIG_SETMASK, &sigset, NULL);
@@ -79,19 +477,47 @@ int make_signal_fd() {
     return signal_fd;
 }
 
-void register_fd(const int epoll_fd, const int fd) {
+// fd_ptr is stored as epoll data, so it has to stay valid while registered
+void register_fd(const int epoll_fd, int* fd_ptr, const uint32_t events) {
     struct epoll_event event;
     memset(&event, 0, sizeof(event));
-    event.data.fd = fd;
-    event.events = EPOLLIN;
-    CHECK_OR_EXIT(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event),
+    event.data.ptr = fd_ptr;
+    event.events = events;
+    CHECK_OR_EXIT(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *fd_ptr, &event),
                   "epoll_ctl add fd");
 }
 
-int create_socket(const int port_number) {
-    const int socket_fd = socket(/* domain = */ AF_INET, /* type = */ SOCK_STREAM, 0);
+// Periodic tick that closes idle connections.
+int make_timer_fd() {
+    const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    CHECK_OR_EXIT(timer_fd, "timerfd_create");
+
+    const struct itimerspec interval = {
+        .it_interval = {.tv_sec = 1},
+        .it_value = {.tv_sec = 1}
+    };
+    CHECK_OR_EXIT(timerfd_settime(timer_fd, 0, &interval, NULL), "timerfd_settime");
+    return timer_fd;
+}
+
+time_t monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+int create_socket(const int port_number, const int nonblocking) {
+    const int socket_fd = socket(/* domain = */ AF_INET,
+                                 /* type = */ SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
     CHECK_OR_EXIT(socket_fd, "socket");
 
+    // every worker binds its own socket to the same port,
+    // the kernel balances new connections between them
+    const int enable = 1;
+    CHECK_OR_EXIT(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT,
+                             &enable, sizeof(enable)),
+                  "setsockopt SO_REUSEPORT");
+
     const struct sockaddr_in addr_in = {
         .sin_family = AF_INET,
         .sin_port = htons(port_number),
@@ -104,81 +530,2615 @@ int create_socket(const int port_number) {
     return socket_fd;
 }
 
-void main_loop(const int epoll_fd, const int signal_fd, const int socket_fd,
-               const char* const path_to_directory) {
-    struct epoll_event events[kMaxEventsToRead];
-    char buffer[kSize + 1];
-    char filename[FILENAME_MAX];
-    char full_path[kSize + 1];
+int would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void unlink_connection(struct worker* worker, struct connection* connection) {
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        worker->connections = connection->next;
+    }
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    } else {
+        worker->connections_tail = connection->prev;
+    }
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+void append_connection(struct worker* worker, struct connection* connection) {
+    connection->prev = worker->connections_tail;
+    connection->next = NULL;
+    if (worker->connections_tail) {
+        worker->connections_tail->next = connection;
+    } else {
+        worker->connections = connection;
+    }
+    worker->connections_tail = connection;
+}
+
+// Moves the connection to the tail of the activity list.
+void touch_connection(struct worker* worker, struct connection* connection) {
+    connection->last_activity = worker->now;
+    if (worker->connections_tail != connection) {
+        unlink_connection(worker, connection);
+        append_connection(worker, connection);
+    }
+}
+
+void release_file(struct file_entry* file) {
+    if (--file->references == 0) {
+        if (file->fd != -1) {
+            close(file->fd);
+        }
+        if (file->gzip) {
+            release_file(file->gzip);
+        }
+        free(file->data);
+        free(file->path);
+        free(file);
+    }
+}
+
+// Releases the body of the current response.
+void close_file(struct connection* connection) {
+    if (connection->file) {
+        release_file(connection->file);
+        connection->file = NULL;
+    }
+    free(connection->body);
+    connection->body = NULL;
+}
+
+void free_connection(struct connection* connection) {
+    // close also removes the descriptor from the epoll set
+    close(connection->fd);
+    close_file(connection);
+    if (connection->pipe_fds[0] != -1) {
+        close(connection->pipe_fds[0]);
+        close(connection->pipe_fds[1]);
+    }
+    free(connection->buffer);
+    free(connection);
+}
+
+void close_connection(struct worker* worker, struct connection* connection) {
+    unlink_connection(worker, connection);
+    --worker->active_connections;
+    flush_bytes_sent(worker, connection);
+    counter_add(&worker->metrics.closed, 1);
+#ifdef HAVE_IO_URING
+    if (connection->pending_operations > 0) {
+        // completions still point to the connection, the last one frees it;
+        // shutdown wakes up receives and sends that would wait forever
+        connection->closing = 1;
+        ++worker->closing_connections;
+        shutdown(connection->fd, SHUT_RDWR);
+        return;
+    }
+#endif
+    free_connection(connection);
+}
+
+void fail_connection(struct worker* worker, struct connection* connection,
+                     const enum error_stage stage) {
+    record_error(worker, stage);
+    close_connection(worker, connection);
+}
+
+// Returns -1 if the connection could not be updated and has to be closed.
+int set_events(struct worker* worker, struct connection* connection,
+               const uint32_t events) {
+    if (connection->events == events) {
+        return 0;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = connection;
+    event.events = events;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1) {
+        return -1;
+    }
+    connection->events = events;
+    return 0;
+}
+
+// Returns NULL (and closes accept_fd) when out of memory.
+struct connection* add_connection(struct worker* worker, const int accept_fd) {
+    struct connection* connection = calloc(1, sizeof(struct connection));
+    if (connection == NULL) {
+        record_error(worker, kMemoryError);
+        close(accept_fd);
+        return NULL;
+    }
+    counter_add(&worker->metrics.accepted, 1);
+    connection->fd = accept_fd;
+    connection->pipe_fds[0] = -1;
+    connection->pipe_fds[1] = -1;
+    connection->state = kReadingRequest;
+    connection->last_activity = worker->now;
+
+    append_connection(worker, connection);
+    ++worker->active_connections;
+    return connection;
+}
+
+void accept_connections(struct worker* worker) {
+    // the listening socket is non-blocking, take the whole backlog at once
+    while (1) {
+        const uint64_t started = monotonic_nanoseconds();
+        const int accept_fd = accept4(worker->socket_fd, NULL, NULL, SOCK_NONBLOCK);
+        record_latency(worker, kAcceptSyscall, started);
+        if (accept_fd == -1) {
+            if (would_block() || errno == EINTR) {
+                return;
+            }
+            // the rest stays in the backlog, e.g. until descriptors are freed
+            record_error(worker, kAcceptError);
+            return;
+        }
+
+        struct connection* connection = add_connection(worker, accept_fd);
+        if (connection == NULL) {
+            continue;
+        }
+        connection->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event event = {
+            .events = connection->events,
+            .data.ptr = &connection->fd
+        };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, accept_fd, &event) == -1) {
+            fail_connection(worker, connection, kEpollError);
+        }
+    }
+}
+
+// Drops connections without a request in progress, used on shutdown.
+void close_waiting_connections(struct worker* worker) {
+    struct connection* connection = worker->connections;
+    while (connection) {
+        struct connection* next = connection->next;
+        if (connection->state == kReadingRequest &&
+            connection->buffer_size == connection->request_begin) {
+            close_connection(worker, connection);
+        }
+        connection = next;
+    }
+}
+
+// Stop taking new connections. Requests already started are served,
+// connections without a pending request are dropped.
+void stop_accepting(struct worker* worker) {
+    if (worker->stopping) {
+        return;
+    }
+    worker->stopping = 1;
+    // nobody reads the signalfd, so it stays readable for every worker
+    CHECK_OR_EXIT(epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->signal_fd, NULL),
+                  "epoll_ctl del signal_fd");
+    close(worker->socket_fd);
+    worker->socket_fd = -1;
+    close_waiting_connections(worker);
+}
+
+// FNV-1a
+uint64_t hash_path(const char* path, const size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void cache_init(struct file_cache* cache) {
+    memset(cache, 0, sizeof(*cache));
+    cache->inotify_fd = -1;
+    if (options.cache_capacity == 0) {
+        return;
+    }
+
+    cache->buckets_count = 1;
+    while (cache->buckets_count < 2 * (size_t)options.cache_capacity) {
+        cache->buckets_count *= 2;
+    }
+    cache->buckets = calloc(cache->buckets_count, sizeof(struct file_entry*));
+    assert(cache->buckets != NULL);
+
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    CHECK_OR_EXIT(cache->inotify_fd, "inotify_init1");
+}
+
+void cache_lru_unlink(struct file_cache* cache, struct file_entry* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+void cache_lru_push_front(struct file_cache* cache, struct file_entry* entry) {
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+void cache_remove(struct file_cache* cache, struct file_entry* entry) {
+    struct file_entry** slot = &cache->buckets[entry->hash & (cache->buckets_count - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+    cache_lru_unlink(cache, entry);
+    --cache->size;
+    if (entry->gzip && entry->gzip->data) {
+        cache->compressed_size -= entry->gzip->size;
+    }
+    entry->cached = 0;
+    release_file(entry);
+}
+
+void cache_clear(struct file_cache* cache) {
+    while (cache->lru_head) {
+        cache_remove(cache, cache->lru_head);
+    }
+}
+
+struct file_entry* cache_find(struct file_cache* cache, const char* path,
+                              const size_t length, const uint64_t hash) {
+    struct file_entry* entry = cache->buckets[hash & (cache->buckets_count - 1)];
+    for (; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->path_length == length &&
+            memcmp(entry->path, path, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void cache_insert(struct file_cache* cache, struct file_entry* entry) {
+    struct file_entry** bucket = &cache->buckets[entry->hash & (cache->buckets_count - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_lru_push_front(cache, entry);
+    entry->cached = 1;
+    ++entry->references;
+    if (++cache->size > options.cache_capacity) {
+        cache_remove(cache, cache->lru_tail);
+    }
+}
+
+// Watches the directory of path, so that the entry can be dropped on change.
+// Must be called before the file is opened, otherwise a change in between
+// would be missed. Returns -1 if the directory can not be watched.
+int cache_watch_directory(struct file_cache* cache, const char* path,
+                          const size_t length) {
+    char full_path[PATH_MAX];
+    const char* slash = memrchr(path, '/', length);
+    const size_t directory_length = slash ? (size_t)(slash - path) : 0;
+    snprintf(full_path, sizeof(full_path), "%s/%.*s", options.path_to_directory,
+             (int)directory_length, path);
+
+    const int wd = inotify_add_watch(
+        cache->inotify_fd, full_path,
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+            IN_ONLYDIR);
+    if (wd == -1) {
+        return -1;
+    }
+
+    if (wd >= cache->watched_directories_capacity) {
+        const int capacity = 2 * wd + 16;
+        char** directories = realloc(cache->watched_directories, capacity * sizeof(char*));
+        if (directories == NULL) {
+            return -1;
+        }
+        memset(directories + cache->watched_directories_capacity, 0,
+               (capacity - cache->watched_directories_capacity) * sizeof(char*));
+        cache->watched_directories = directories;
+        cache->watched_directories_capacity = capacity;
+    }
+    if (cache->watched_directories[wd] == NULL) {
+        cache->watched_directories[wd] = strndup(path, directory_length);
+        if (cache->watched_directories[wd] == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cache_handle_inotify(struct file_cache* cache) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
 
     while (1) {
-        CHECK_OR_EXIT(epoll_wait(epoll_fd, events, kMaxEventsToRead, -1),
-                      "epoll_wait");
-        if (events[0].data.fd == signal_fd) {
-            close(signal_fd);
-            close(socket_fd);
-            close(epoll_fd);
-            exit(EXIT_SUCCESS);
-        }
-        if (events[0].data.fd == socket_fd) {
-            const int accept_fd = accept(socket_fd, NULL, NULL);
-            CHECK_OR_EXIT(accept_fd, "accept");
-            register_fd(epoll_fd, accept_fd);
+        const ssize_t amount_of_read = read(cache->inotify_fd, buffer, sizeof(buffer));
+        if (amount_of_read == -1 && errno == EINTR) {
             continue;
         }
+        if (amount_of_read <= 0) {
+            return;
+        }
 
-        const int accept_fd = events[0].data.fd;
-        CHECK_OR_EXIT(fcntl(accept_fd, F_SETFD, fcntl(accept_fd, F_GETFL) | O_NONBLOCK),
-                      "fcntl");
+        for (char* ptr = buffer; ptr < buffer + amount_of_read;) {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
 
-        const ssize_t amount_of_read = read(accept_fd, buffer, kSize);
-        CHECK_OR_EXIT(amount_of_read, "read");
+            const int subdirectory_changed =
+                (event->mask & IN_ISDIR) && !(event->mask & IN_CREATE);
+            if (subdirectory_changed ||
+                (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF |
+                                IN_IGNORED))) {
+                // whole subtrees may be affected, start from scratch
+                cache_clear(cache);
+                if ((event->mask & IN_IGNORED) && event->wd >= 0 &&
+                    event->wd < cache->watched_directories_capacity) {
+                    free(cache->watched_directories[event->wd]);
+                    cache->watched_directories[event->wd] = NULL;
+                }
+                continue;
+            }
+            if (event->len == 0 || event->wd < 0 ||
+                event->wd >= cache->watched_directories_capacity ||
+                cache->watched_directories[event->wd] == NULL) {
+                continue;
+            }
 
-        buffer[amount_of_read] = '\0';
-        sscanf(buffer, "GET %s HTTP/1.1\r\n", filename);
-        // while (read(accept_fd, buffer, kSize) > 0) { }
+            const char* directory = cache->watched_directories[event->wd];
+            const int length = snprintf(path, sizeof(path), "%s%s%s", directory,
+                                        directory[0] ? "/" : "", event->name);
+            if (length < 0 || length >= (int)sizeof(path)) {
+                continue;
+            }
+            struct file_entry* entry =
+                cache_find(cache, path, length, hash_path(path, length));
+            if (entry) {
+                cache_remove(cache, entry);
+            }
+            if (length > 3 && memcmp(path + length - 3, ".gz", 3) == 0) {
+                // the gzip sibling of a cached file changed
+                entry = cache_find(cache, path, length - 3, hash_path(path, length - 3));
+                if (entry) {
+                    cache_remove(cache, entry);
+                }
+            }
+        }
+    }
+}
+
+// Returns a referenced cached entry or NULL.
+struct file_entry* cache_acquire(struct file_cache* cache, const char* path,
+                                 const size_t length, const uint64_t hash) {
+    if (cache->buckets == NULL) {
+        return NULL;
+    }
+    struct file_entry* entry = cache_find(cache, path, length, hash);
+    if (entry) {
+        cache_lru_unlink(cache, entry);
+        cache_lru_push_front(cache, entry);
+        ++entry->references;
+    }
+    return entry;
+}
+
+void format_http_date(const time_t time, char* date) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    strftime(date, kHttpDateCapacity, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
 
-        sprintf(full_path, "%s/%s", path_to_directory, filename);
+// Parses an IMF-fixdate, the only format senders may generate.
+// Returns -1 if the value is not one.
+time_t parse_http_date(const char* value, const size_t length) {
+    char date[kHttpDateCapacity];
+    if (length >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value, length);
+    date[length] = '\0';
+    struct tm tm = {0};
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
 
-        if (access(full_path, F_OK)) {
-            WRITE_AND_CHECK("HTTP/1.1 404 Not Found\r\n", "write 404");
+int has_compressible_extension(const char* path, const size_t length) {
+    const char* dot = memrchr(path, '.', length);
+    if (dot == NULL || memchr(dot, '/', path + length - dot)) {
+        return 0;
+    }
+    const size_t extension_length = path + length - dot - 1;
+    for (size_t i = 0; i < sizeof(kCompressibleExtensions) / sizeof(kCompressibleExtensions[0]); ++i) {
+        if (strlen(kCompressibleExtensions[i]) == extension_length &&
+            strncasecmp(dot + 1, kCompressibleExtensions[i], extension_length) == 0) {
+            return 1;
         }
-        if (access(full_path, R_OK)) {
-            WRITE_AND_CHECK("HTTP/1.1 403 Forbidden\r\n", "write 403");
+    }
+    return 0;
+}
+
+// Returns a referenced entry that is not cached yet, or NULL with errno set.
+// fd is closed on failure.
+struct file_entry* new_file_entry(const char* path, const size_t length,
+                                  const int fd, const off_t size, const time_t mtime) {
+    struct file_entry* entry = calloc(1, sizeof(struct file_entry));
+    if (entry == NULL || (entry->path = strndup(path, length)) == NULL) {
+        free(entry);
+        if (fd != -1) {
+            close(fd);
         }
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->path_length = length;
+    entry->fd = fd;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->references = 1;
+    return entry;
+}
 
-        int fd = open(full_path, 0);
-        CHECK_OR_EXIT(fd, "open");
+void render_file_header(struct file_entry* entry) {
+    entry->etag_length = snprintf(
+        entry->etag, sizeof(entry->etag), "\"%llx-%llx%s\"", (long long)entry->mtime,
+        (long long)entry->size, entry->gzip_encoded ? "-gz" : "");
+    char last_modified[kHttpDateCapacity];
+    format_http_date(entry->mtime, last_modified);
+    entry->validators_offset = snprintf(
+        entry->header, sizeof(entry->header),
+        "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n", (long long)entry->size);
+    entry->header_size = entry->validators_offset + snprintf(
+        entry->header + entry->validators_offset,
+        sizeof(entry->header) - entry->validators_offset,
+        "%s%sLast-Modified: %s\r\nETag: %s\r\nAccept-Ranges: bytes\r\n",
+        entry->gzip_encoded ? "Content-Encoding: gzip\r\n" : "",
+        entry->gzip_encoded || entry->compressible ? "Vary: Accept-Encoding\r\n" : "",
+        last_modified, entry->etag);
+}
 
-        struct stat stat;
-        fstat(fd, &stat);
+// Wraps an open regular file into a referenced entry and caches it when its
+// directory is watched. Returns NULL with errno set, fd is closed then.
+struct file_entry* make_file_entry(
+    struct file_cache* cache, const char* path, const size_t length,
+    const uint64_t hash, const int fd, const off_t size, const time_t mtime,
+    const int watched) {
+    struct file_entry* entry = new_file_entry(path, length, fd, size, mtime);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->compressible = options.gzip && has_compressible_extension(path, length);
+    render_file_header(entry);
+
+    if (watched) {
+        cache_insert(cache, entry);
+    }
+    return entry;
+}
 
-        WRITE_AND_CHECK("HTTP/1.1 200 OK\r\n", "write 200");
-        dprintf(accept_fd, "Content-Length: %ld\r\n\r\n", stat.st_size);
-        sendfile(accept_fd, fd, NULL, stat.st_size);
+// Opens the file at the normalized path, through the cache if it is enabled.
+// Returns a referenced entry or NULL with errno set.
+struct file_entry* acquire_file(struct file_cache* cache, const char* path,
+                                const size_t length) {
+    const uint64_t hash = hash_path(path, length);
+    struct file_entry* entry = cache_acquire(cache, path, length, hash);
+    if (entry) {
+        return entry;
+    }
+
+    const int watched =
+        cache->buckets && cache_watch_directory(cache, path, length) == 0;
 
+    const int fd = openat(options.directory_fd, length ? path : ".",
+                          O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat stat;
+    if (fstat(fd, &stat) == -1 || !S_ISREG(stat.st_mode)) {
         close(fd);
-        shutdown(accept_fd, 0);
-        CHECK_OR_EXIT(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL),
-                      "epoll_ctl del fd");
+        errno = ENOENT;
+        return NULL;
     }
+    return make_file_entry(cache, path, length, hash, fd, stat.st_size,
+                           stat.st_mtime, watched);
 }
 
-int main(int argc, char** argv) {
-    assert(argc == 3);
+// Takes over data (or fd) and returns the gzip representation of file.
+struct file_entry* new_gzip_entry(const struct file_entry* file, const int fd,
+                                  char* data, const off_t size, const time_t mtime) {
+    struct file_entry* entry = new_file_entry(file->path, file->path_length, fd, size, mtime);
+    if (entry == NULL) {
+        free(data);
+        return NULL;
+    }
+    entry->data = data;
+    entry->gzip_encoded = 1;
+    render_file_header(entry);
+    return entry;
+}
 
-    int port_number;
-    sscanf(argv[1], "%d", &port_number);
+// Opens "<path>.gz" next to the file, unless it is missing or older.
+struct file_entry* open_gzip_sibling(const struct file_entry* file) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.gz", file->path) >= (int)sizeof(path)) {
+        return NULL;
+    }
+    const int fd = openat(options.directory_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat stat;
+    if (fstat(fd, &stat) == -1 || !S_ISREG(stat.st_mode) || stat.st_mtime < file->mtime) {
+        close(fd);
+        return NULL;
+    }
+    return new_gzip_entry(file, fd, NULL, stat.st_size, stat.st_mtime);
+}
+
+// Deflates the whole file into memory. Returns NULL if the file is out of
+// the size limits, can not be read or does not get smaller.
+struct file_entry* compress_file(const struct file_entry* file) {
+    if (file->size < kMinCompressedFileSize || file->size > kMaxCompressedFileSize) {
+        return NULL;
+    }
+    char* input = malloc(file->size);
+    if (input == NULL) {
+        return NULL;
+    }
+    off_t input_size = 0;
+    while (input_size < file->size) {
+        const ssize_t amount_of_read =
+            pread(file->fd, input + input_size, file->size - input_size, input_size);
+        if (amount_of_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (amount_of_read <= 0) {
+            break;
+        }
+        input_size += amount_of_read;
+    }
 
-    const char* const path_to_directory = argv[2];
+    char* output = NULL;
+    size_t output_size = 0;
+    z_stream stream = {0};
+    // 15 + 16: the largest window with a gzip wrapper instead of zlib's
+    if (input_size == file->size &&
+        deflateInit2(&stream, kGzipLevel, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) == Z_OK) {
+        const uLong bound = deflateBound(&stream, input_size);
+        output = malloc(bound);
+        if (output) {
+            stream.next_in = (Bytef*)input;
+            stream.avail_in = input_size;
+            stream.next_out = (Bytef*)output;
+            stream.avail_out = bound;
+            if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+                output_size = stream.total_out;
+            }
+        }
+        deflateEnd(&stream);
+    }
+    free(input);
 
-    const int epoll_fd = make_epoll();
+    if (output_size == 0 || output_size >= (size_t)file->size) {
+        free(output);
+        return NULL;
+    }
+    char* shrunk = realloc(output, output_size);
+    return new_gzip_entry(file, -1, shrunk ? shrunk : output, output_size, file->mtime);
+}
 
-    const int signal_fd = make_signal_fd();
-    register_fd(epoll_fd, signal_fd);
+// Drops compressed bodies of the least recently used entries other than
+// keep until the worker's budget is met. The entries stay checked and are
+// sent as they are: compressing them again would only evict others.
+void cache_trim_compressed(struct file_cache* cache, const struct file_entry* keep) {
+    struct file_entry* entry = cache->lru_tail;
+    for (; entry && cache->compressed_size > options.gzip_cache_size;
+         entry = entry->lru_prev) {
+        if (entry != keep && entry->gzip && entry->gzip->data) {
+            cache->compressed_size -= entry->gzip->size;
+            release_file(entry->gzip);
+            entry->gzip = NULL;
+        }
+    }
+}
+
+// Returns the referenced gzip representation of a compressible file or NULL.
+// It is looked up once per cached entry: the .gz sibling, else the file is
+// compressed into memory. Compression blocks the worker, so an entry that
+// is not cached gets the sibling only.
+struct file_entry* acquire_gzip(struct file_cache* cache, struct file_entry* file) {
+    if (file->gzip_checked) {
+        if (file->gzip) {
+            ++file->gzip->references;
+        }
+        return file->gzip;
+    }
+
+    struct file_entry* gzip = open_gzip_sibling(file);
+    if (!file->cached) {
+        // nowhere to keep it, the response owns it alone
+        return gzip;
+    }
+    if (gzip == NULL) {
+        gzip = compress_file(file);
+    }
+    file->gzip_checked = 1;
+    if (gzip && gzip->data && (size_t)gzip->size > options.gzip_cache_size) {
+        // too big for the budget: this response takes it, later ones get the
+        // file as is instead of compressing it again
+        return gzip;
+    }
+    file->gzip = gzip;
+    if (gzip) {
+        ++gzip->references;
+        if (gzip->data) {
+            cache->compressed_size += gzip->size;
+            cache_trim_compressed(cache, file);
+        }
+    }
+    return gzip;
+}
+
+// Connection headers and the empty line that ends the response header.
+const char* connection_header(const struct connection* connection) {
+    if (!options.keep_alive) {
+        return "\r\n";
+    }
+    return connection->keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                  : "Connection: close\r\n\r\n";
+}
 
-    const int socket_fd = create_socket(port_number);
-    register_fd(epoll_fd, socket_fd);
+void set_header_parts(struct connection* connection, const char* header,
+                      const size_t header_size) {
+    const char* tail = connection_header(connection);
+    connection->response_parts[0].iov_base = (void*)header;
+    connection->response_parts[0].iov_len = header_size;
+    connection->response_parts[1].iov_base = (void*)tail;
+    connection->response_parts[1].iov_len = strlen(tail);
+    connection->response_parts[2].iov_base = NULL;
+    connection->response_parts[2].iov_len = 0;
+    connection->state = kWritingHeader;
+}
+
+size_t response_parts_left(const struct connection* connection) {
+    size_t left = 0;
+    for (int i = 0; i < kResponseParts; ++i) {
+        left += connection->response_parts[i].iov_len;
+    }
+    return left;
+}
+
+void advance_response_parts(struct connection* connection, size_t written) {
+    for (int i = 0; i < kResponseParts; ++i) {
+        struct iovec* part = &connection->response_parts[i];
+        const size_t step = written < part->iov_len ? written : part->iov_len;
+        part->iov_base = (char*)part->iov_base + step;
+        part->iov_len -= step;
+        written -= step;
+    }
+}
+
+void prepare_header(struct connection* connection, const char* status,
+                    const off_t content_length) {
+    connection->status = atoi(status);
+    const size_t header_size = snprintf(
+        connection->header, sizeof(connection->header),
+        "HTTP/1.1 %s\r\nContent-Length: %lld\r\n", status, (long long)content_length);
+    set_header_parts(connection, connection->header, header_size);
+}
+
+// Malformed requests leave the stream in an unknown state, answer and close.
+void prepare_error(struct connection* connection, const char* status) {
+    connection->keep_alive = 0;
+    prepare_header(connection, status, 0);
+}
+
+// Returns the value of header `name` in [headers, end) or NULL.
+// The value is not terminated, its size is stored to *length.
+const char* find_header(const char* headers, const char* end,
+                        const char* name, size_t* length) {
+    const size_t name_length = strlen(name);
+    const char* line = headers;
+    while (line < end) {
+        const char* line_end = memmem(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        if (line_end - line > (ssize_t)name_length &&
+            line[name_length] == ':' &&
+            strncasecmp(line, name, name_length) == 0) {
+            const char* value = line + name_length + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            const char* value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                --value_end;
+            }
+            *length = value_end - value;
+            return value;
+        }
+        line = line_end + 2;
+    }
+    return NULL;
+}
+
+// Whether the header value (a comma separated list) contains the token.
+int has_token(const char* value, const size_t length, const char* token) {
+    const size_t token_length = strlen(token);
+    for (size_t i = 0; i + token_length <= length; ++i) {
+        if (strncasecmp(value + i, token, token_length) == 0 &&
+            (i == 0 || value[i - 1] == ',' || value[i - 1] == ' ') &&
+            (i + token_length == length || value[i + token_length] == ',' ||
+             value[i + token_length] == ' ')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the Accept-Encoding value allows gzip: "gzip", "x-gzip" or "*"
+// without "q=0". An explicit gzip entry wins over "*".
+int accepts_gzip(const char* value, const size_t length) {
+    const char* end = value + length;
+    int gzip = -1;
+    int any = -1;
+    while (value < end) {
+        const char* item_end = memchr(value, ',', end - value);
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        while (value < item_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        const char* coding_end = value;
+        while (coding_end < item_end && *coding_end != ';' && *coding_end != ' ' &&
+               *coding_end != '\t') {
+            ++coding_end;
+        }
+        const size_t coding_length = coding_end - value;
+        // the value is followed by "\r\n", strtod stops there at the latest
+        const char* weight = memmem(coding_end, item_end - coding_end, "q=", 2);
+        const int acceptable = weight == NULL || strtod(weight + 2, NULL) > 0;
+        if ((coding_length == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+            (coding_length == 6 && strncasecmp(value, "x-gzip", 6) == 0)) {
+            gzip = acceptable;
+        } else if (coding_length == 1 && *value == '*') {
+            any = acceptable;
+        }
+        value = item_end + 1;
+    }
+    return gzip != -1 ? gzip : any == 1;
+}
+
+// Turns the request target into a path relative to the served directory:
+// drops the query, empty and "." segments and resolves "..".
+// Returns the path length or -1 if the target leaves the directory
+// or does not fit.
+ssize_t normalize_path(const char* target, char* path, const size_t capacity) {
+    size_t length = 0;
+    const char* segment = target;
+    while (*segment && *segment != '?' && *segment != '#') {
+        size_t segment_length = strcspn(segment, "/?#");
+        if (segment_length == 0 ||
+            (segment_length == 1 && segment[0] == '.')) {
+            // nothing to append
+        } else if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (length == 0) {
+                return -1;
+            }
+            char* slash = memrchr(path, '/', length);
+            length = slash ? (size_t)(slash - path) : 0;
+        } else {
+            if (length + 1 + segment_length + 1 > capacity) {
+                return -1;
+            }
+            if (length) {
+                path[length++] = '/';
+            }
+            memcpy(path + length, segment, segment_length);
+            length += segment_length;
+        }
+        segment += segment_length;
+        if (*segment == '/') {
+            ++segment;
+        }
+    }
+    path[length] = '\0';
+    return length;
+}
 
-    main_loop(epoll_fd, signal_fd, socket_fd, path_to_directory);
-}
\ No newline at end of file
+// Parses the complete request in
+// [connection->request_begin, connection->request_end) and stores the
+// normalized path of the target. Returns its length, or -1 if the request
+// is already answered with an error.
+ssize_t parse_request(struct worker* worker, struct connection* connection,
+                      char* path, const size_t capacity) {
+    // request line: GET <target> HTTP/1.1\r\n
+    char* request_line = connection->buffer + connection->request_begin;
+    char* request_end = connection->buffer + connection->request_end;
+    char* line_end = memmem(request_line, request_end - request_line, "\r\n", 2);
+    *line_end = '\0';
+
+    char* target = NULL;
+    char* version = NULL;
+    if (strncmp(request_line, "GET ", 4) == 0) {
+        target = request_line + 4;
+        version = strchr(target, ' ');
+    }
+    if (version == NULL || version == target ||
+        strncmp(version, " HTTP/1.", 8) != 0) {
+        prepare_error(connection, "400 Bad Request");
+        return -1;
+    }
+    *version = '\0';
+    connection->headers_begin = line_end + 2 - connection->buffer;
+
+    if (options.keep_alive && !worker->stopping) {
+        // HTTP/1.1 connections are persistent by default, HTTP/1.0 ones are not
+        size_t length = 0;
+        const char* value = find_header(line_end + 2, request_end, "Connection", &length);
+        if (version[8] == '0') {
+            connection->keep_alive = value && has_token(value, length, "keep-alive");
+        } else {
+            connection->keep_alive = !(value && has_token(value, length, "close"));
+        }
+    } else {
+        connection->keep_alive = 0;
+    }
+
+    const ssize_t length = normalize_path(target, path, capacity);
+    if (length == -1) {
+        prepare_header(connection, "404 Not Found", 0);
+    }
+    return length;
+}
+
+void respond_with_open_error(struct connection* connection, const int error) {
+    if (error == EACCES) {
+        prepare_header(connection, "403 Forbidden", 0);
+    } else {
+        prepare_header(connection, "404 Not Found", 0);
+    }
+}
+
+// Whether the comma separated If-None-Match value lists the entity tag.
+// The comparison is weak: a W/ prefix is ignored.
+int etag_matches(const char* value, const size_t length,
+                 const struct file_entry* file) {
+    const char* end = value + length;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            ++value;
+        }
+        if (value == end) {
+            break;
+        }
+        const size_t remaining = (size_t)(end - value);
+        const char* tag_end = memchr(value, ',', remaining);
+        if (tag_end == NULL) {
+            tag_end = end;
+        }
+        const char* tag = value;
+        const char* tag_last = tag_end;
+        while (tag_last > tag && (tag_last[-1] == ' ' || tag_last[-1] == '\t')) {
+            --tag_last;
+        }
+        if (tag_last - tag == 1 && *tag == '*') {
+            return 1;
+        }
+        if (tag_last - tag > 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+        }
+        if ((size_t)(tag_last - tag) == file->etag_length &&
+            memcmp(tag, file->etag, file->etag_length) == 0) {
+            return 1;
+        }
+        value = tag_end;
+    }
+    return 0;
+}
+
+// Evaluates If-None-Match, or If-Modified-Since without it.
+int not_modified(const struct file_entry* file, const char* headers,
+                 const char* end) {
+    size_t length = 0;
+    const char* value = find_header(headers, end, "If-None-Match", &length);
+    if (value) {
+        return etag_matches(value, length, file);
+    }
+    value = find_header(headers, end, "If-Modified-Since", &length);
+    if (value) {
+        const time_t since = parse_http_date(value, length);
+        return since != -1 && file->mtime <= since;
+    }
+    return 0;
+}
+
+// Parses a decimal number of at most 18 digits. Returns the position after
+// it or NULL.
+const char* parse_offset(const char* value, const char* end, off_t* number) {
+    const char* digits = value;
+    *number = 0;
+    while (value < end && *value >= '0' && *value <= '9' && value - digits < 18) {
+        *number = *number * 10 + (*value - '0');
+        ++value;
+    }
+    return value == digits || (value < end && *value >= '0' && *value <= '9')
+               ? NULL : value;
+}
+
+enum range_result {
+    kWholeFile,
+    kPartialFile,
+    kRangeNotSatisfiable,
+};
+
+// Applies the Range header to the file: [*first, *last] is the part to send.
+// Ranges that cannot be parsed, several ranges and ranges with an outdated
+// If-Range are ignored, the whole file is sent then.
+enum range_result parse_range(const struct file_entry* file, const char* headers,
+                              const char* end, off_t* first, off_t* last) {
+    size_t length = 0;
+    const char* value = find_header(headers, end, "Range", &length);
+    if (value == NULL || length < 6 || strncasecmp(value, "bytes=", 6) != 0 ||
+        memchr(value, ',', length)) {
+        return kWholeFile;
+    }
+
+    size_t if_range_length = 0;
+    const char* if_range = find_header(headers, end, "If-Range", &if_range_length);
+    if (if_range) {
+        // entity tags are compared strongly here, ours are never weak
+        const int fresh = *if_range == '"' || *if_range == 'W'
+            ? if_range_length == file->etag_length &&
+                  memcmp(if_range, file->etag, if_range_length) == 0
+            : parse_http_date(if_range, if_range_length) == file->mtime;
+        if (!fresh) {
+            return kWholeFile;
+        }
+    }
+
+    const char* spec = value + 6;
+    const char* spec_end = value + length;
+    if (spec < spec_end && *spec == '-') {
+        // the last N bytes
+        off_t suffix = 0;
+        if (parse_offset(spec + 1, spec_end, &suffix) != spec_end) {
+            return kWholeFile;
+        }
+        if (suffix == 0 || file->size == 0) {
+            return kRangeNotSatisfiable;
+        }
+        *first = suffix < file->size ? file->size - suffix : 0;
+        *last = file->size - 1;
+        return kPartialFile;
+    }
+
+    const char* dash = parse_offset(spec, spec_end, first);
+    if (dash == NULL || dash == spec_end || *dash != '-') {
+        return kWholeFile;
+    }
+    *last = file->size - 1;
+    if (dash + 1 < spec_end) {
+        off_t range_last = 0;
+        if (parse_offset(dash + 1, spec_end, &range_last) != spec_end ||
+            range_last < *first) {
+            return kWholeFile;
+        }
+        if (range_last < *last) {
+            *last = range_last;
+        }
+    }
+    return *first < file->size ? kPartialFile : kRangeNotSatisfiable;
+}
+
+// Takes over the reference to file. Answers with the whole file (or its
+// gzip representation), the requested range of it, 304 or 416 depending on
+// the request headers.
+void respond_with_file(struct file_cache* cache, struct connection* connection,
+                       struct file_entry* file) {
+    const char* headers = connection->buffer + connection->headers_begin;
+    const char* end = connection->buffer + connection->request_end;
+    if (file->compressible) {
+        size_t length = 0;
+        const char* value = find_header(headers, end, "Accept-Encoding", &length);
+        struct file_entry* gzip =
+            value && accepts_gzip(value, length) ? acquire_gzip(cache, file) : NULL;
+        if (gzip) {
+            release_file(file);
+            file = gzip;
+        }
+    }
+    const char* validators = file->header + file->validators_offset;
+    const int validators_size = file->header_size - file->validators_offset;
+
+    if (not_modified(file, headers, end)) {
+        const size_t header_size = snprintf(
+            connection->header, sizeof(connection->header),
+            "HTTP/1.1 304 Not Modified\r\n%.*s", validators_size, validators);
+        connection->status = 304;
+        release_file(file);
+        set_header_parts(connection, connection->header, header_size);
+        return;
+    }
+
+    off_t first = 0;
+    off_t last = 0;
+    const enum range_result range = parse_range(file, headers, end, &first, &last);
+    if (range == kRangeNotSatisfiable) {
+        const size_t header_size = snprintf(
+            connection->header, sizeof(connection->header),
+            "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n",
+            (long long)file->size);
+        connection->status = 416;
+        release_file(file);
+        set_header_parts(connection, connection->header, header_size);
+        return;
+    }
+
+    connection->file = file;
+    connection->status = range == kWholeFile ? 200 : 206;
+    if (range == kWholeFile) {
+        first = 0;
+        last = file->size - 1;
+        set_header_parts(connection, file->header, file->header_size);
+    } else {
+        const size_t header_size = snprintf(
+            connection->header, sizeof(connection->header),
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n%.*s",
+            (long long)first, (long long)last, (long long)file->size,
+            (long long)(last + 1 - first), validators_size, validators);
+        set_header_parts(connection, connection->header, header_size);
+    }
+    connection->file_offset = first;
+    connection->file_end = last + 1;
+    if (file->data) {
+        // an in-memory body goes out in the same sendmsg as the header
+        connection->response_parts[2].iov_base = file->data + first;
+        connection->response_parts[2].iov_len = last + 1 - first;
+        connection->file_offset = connection->file_end;
+    }
+}
+
+// Renders the counters of all workers in the Prometheus text format.
+// Returns the malloc-ed text or NULL.
+char* render_metrics(size_t* size) {
+    char* text = NULL;
+    FILE* stream = open_memstream(&text, size);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    fprintf(stream, "# HELP http_responses_total Responses sent, by status code.\n"
+                    "# TYPE http_responses_total counter\n");
+    for (size_t i = 0; i <= kStatusCodesCount; ++i) {
+        uint64_t total = 0;
+        for (int j = 0; j < workers_count; ++j) {
+            total += counter_get(&workers[j].metrics.responses[i]);
+        }
+        if (i < kStatusCodesCount) {
+            fprintf(stream, "http_responses_total{code=\"%d\"} %llu\n", kStatusCodes[i],
+                    (unsigned long long)total);
+        } else {
+            fprintf(stream, "http_responses_total{code=\"other\"} %llu\n",
+                    (unsigned long long)total);
+        }
+    }
+
+    uint64_t bytes_sent = 0;
+    uint64_t accepted = 0;
+    uint64_t closed = 0;
+    uint64_t idle_timeouts = 0;
+    for (int i = 0; i < workers_count; ++i) {
+        bytes_sent += counter_get(&workers[i].metrics.bytes_sent);
+        accepted += counter_get(&workers[i].metrics.accepted);
+        closed += counter_get(&workers[i].metrics.closed);
+        idle_timeouts += counter_get(&workers[i].metrics.idle_timeouts);
+    }
+    fprintf(stream,
+            "# HELP http_sent_bytes_total Bytes of headers and bodies written to"
+            " clients, counted when a response or connection ends.\n"
+            "# TYPE http_sent_bytes_total counter\n"
+            "http_sent_bytes_total %llu\n"
+            "# HELP http_connections_accepted_total Accepted connections.\n"
+            "# TYPE http_connections_accepted_total counter\n"
+            "http_connections_accepted_total %llu\n"
+            "# HELP http_connections_closed_total Closed connections.\n"
+            "# TYPE http_connections_closed_total counter\n"
+            "http_connections_closed_total %llu\n"
+            "# HELP http_connections_open Connections accepted and not closed yet.\n"
+            "# TYPE http_connections_open gauge\n"
+            "http_connections_open %llu\n"
+            "# HELP http_idle_timeouts_total Connections closed after --idle-timeout.\n"
+            "# TYPE http_idle_timeouts_total counter\n"
+            "http_idle_timeouts_total %llu\n",
+            (unsigned long long)bytes_sent, (unsigned long long)accepted,
+            (unsigned long long)closed,
+            (unsigned long long)(accepted > closed ? accepted - closed : 0),
+            (unsigned long long)idle_timeouts);
+
+    fprintf(stream, "# HELP http_connection_errors_total Connections closed on an error,"
+                    " by the stage that failed.\n"
+                    "# TYPE http_connection_errors_total counter\n");
+    for (int i = 0; i < kErrorStagesCount; ++i) {
+        uint64_t total = 0;
+        for (int j = 0; j < workers_count; ++j) {
+            total += counter_get(&workers[j].metrics.errors[i]);
+        }
+        fprintf(stream, "http_connection_errors_total{stage=\"%s\"} %llu\n",
+                kErrorStageNames[i], (unsigned long long)total);
+    }
+
+    fprintf(stream, "# HELP http_syscall_duration_seconds Latency of the socket"
+                    " syscalls of the epoll backend.\n"
+                    "# TYPE http_syscall_duration_seconds histogram\n");
+    for (int i = 0; i < kTimedSyscallsCount; ++i) {
+        struct latency_histogram total;
+        memset(&total, 0, sizeof(total));
+        for (int j = 0; j < workers_count; ++j) {
+            const struct latency_histogram* histogram = &workers[j].metrics.syscalls[i];
+            for (size_t k = 0; k <= kLatencyBucketsCount; ++k) {
+                total.buckets[k] += counter_get(&histogram->buckets[k]);
+            }
+            total.sum += counter_get(&histogram->sum);
+            total.count += counter_get(&histogram->count);
+        }
+        // the buckets are cumulative in the exposition format
+        uint64_t cumulative = 0;
+        for (size_t k = 0; k <= kLatencyBucketsCount; ++k) {
+            cumulative += total.buckets[k];
+            if (k < kLatencyBucketsCount) {
+                fprintf(stream,
+                        "http_syscall_duration_seconds_bucket{syscall=\"%s\",le=\"%g\"} %llu\n",
+                        kTimedSyscallNames[i], kLatencyBounds[k] / 1e9,
+                        (unsigned long long)cumulative);
+            } else {
+                fprintf(stream,
+                        "http_syscall_duration_seconds_bucket{syscall=\"%s\",le=\"+Inf\"} %llu\n",
+                        kTimedSyscallNames[i], (unsigned long long)cumulative);
+            }
+        }
+        fprintf(stream,
+                "http_syscall_duration_seconds_sum{syscall=\"%s\"} %.9f\n"
+                "http_syscall_duration_seconds_count{syscall=\"%s\"} %llu\n",
+                kTimedSyscallNames[i], total.sum / 1e9, kTimedSyscallNames[i],
+                (unsigned long long)total.count);
+    }
+
+    if (fclose(stream) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Answers the request if it is for the metrics path. Returns whether it was.
+int respond_with_metrics(struct connection* connection, const char* path,
+                         const size_t length) {
+    if (options.metrics_path == NULL || strlen(options.metrics_path) != length ||
+        memcmp(options.metrics_path, path, length) != 0) {
+        return 0;
+    }
+    size_t size = 0;
+    connection->body = render_metrics(&size);
+    if (connection->body == NULL) {
+        prepare_header(connection, "500 Internal Server Error", 0);
+        return 1;
+    }
+    const size_t header_size = snprintf(
+        connection->header, sizeof(connection->header),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n", size);
+    connection->status = 200;
+    set_header_parts(connection, connection->header, header_size);
+    connection->response_parts[2].iov_base = connection->body;
+    connection->response_parts[2].iov_len = size;
+    return 1;
+}
+
+// Fills the response for the complete request
+// in [connection->request_begin, connection->request_end).
+void prepare_response(struct worker* worker, struct connection* connection) {
+    char path[PATH_MAX];
+    const ssize_t length = parse_request(worker, connection, path, sizeof(path));
+    if (length == -1 || respond_with_metrics(connection, path, length)) {
+        return;
+    }
+
+    struct file_entry* file = acquire_file(&worker->cache, path, length);
+    if (file == NULL) {
+        respond_with_open_error(connection, errno);
+        return;
+    }
+    respond_with_file(&worker->cache, connection, file);
+}
+
+// Looks for the end of the next request among the bytes already received.
+// Returns the offset right after "\r\n\r\n" or 0.
+size_t find_request_end(struct connection* connection) {
+    // the terminator may straddle the previous read, step back 3 bytes
+    size_t from = connection->request_begin;
+    if (connection->scanned > from + 3) {
+        from = connection->scanned - 3;
+    }
+    // nothing received yet, or too little to hold a terminator
+    if (connection->buffer == NULL || connection->buffer_size < from + 4) {
+        return 0;
+    }
+    const char* end = memmem(connection->buffer + from,
+                             connection->buffer_size - from, "\r\n\r\n", 4);
+    if (end) {
+        return end + 4 - connection->buffer;
+    }
+    connection->scanned = connection->buffer_size;
+    return 0;
+}
+
+// Drops the requests already served from the front of the buffer.
+void compact_request_buffer(struct connection* connection) {
+    if (connection->request_begin == 0) {
+        return;
+    }
+    const size_t rest = connection->buffer_size - connection->request_begin;
+    memmove(connection->buffer, connection->buffer + connection->request_begin, rest);
+    connection->buffer_size = rest;
+    connection->scanned = connection->scanned > connection->request_begin
+                              ? connection->scanned - connection->request_begin
+                              : 0;
+    connection->request_begin = 0;
+}
+
+// Makes room for more request bytes. Returns 0 on success, 1 if the request
+// is too large and 431 is prepared, -1 if out of memory.
+int reserve_request_buffer(struct connection* connection) {
+    if (connection->buffer_size < connection->buffer_capacity) {
+        return 0;
+    }
+    if (connection->buffer_capacity >= kMaxRequestSize) {
+        prepare_error(connection, "431 Request Header Fields Too Large");
+        return 1;
+    }
+    const size_t capacity =
+        connection->buffer_capacity ? 2 * connection->buffer_capacity : (size_t)kSize;
+    char* buffer = realloc(connection->buffer, capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+    connection->buffer = buffer;
+    connection->buffer_capacity = capacity;
+    return 0;
+}
+
+// Reads everything available. Returns the offset right after "\r\n\r\n",
+// 0 if the request is not complete yet and -1 if the connection is done.
+ssize_t read_request(struct worker* worker, struct connection* connection) {
+    compact_request_buffer(connection);
+
+    while (1) {
+        const int reserved = reserve_request_buffer(connection);
+        if (reserved == -1) {
+            record_error(worker, kMemoryError);
+            return -1;
+        }
+        if (reserved == 1) {
+            return connection->buffer_size;
+        }
+
+        const uint64_t started = monotonic_nanoseconds();
+        const ssize_t amount_of_read =
+            read(connection->fd, connection->buffer + connection->buffer_size,
+                 connection->buffer_capacity - connection->buffer_size);
+        record_latency(worker, kReadSyscall, started);
+        if (amount_of_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (amount_of_read == -1 && would_block()) {
+            return 0;
+        }
+        if (amount_of_read == -1) {
+            record_error(worker, kReadError);
+        }
+        if (amount_of_read <= 0) {
+            return -1;
+        }
+        connection->buffer_size += amount_of_read;
+
+        const size_t request_end = find_request_end(connection);
+        if (request_end) {
+            return request_end;
+        }
+    }
+}
+
+// Both body senders return 1 when the body is fully sent, 0 when the socket
+// is full or the turn budget is spent and -1 on error.
+int send_body_sendfile(struct worker* worker, struct connection* connection) {
+    size_t budget = kMaxBytesPerTurn;
+    while (connection->file_offset < connection->file_end && budget > 0) {
+        size_t count = connection->file_end - connection->file_offset;
+        if (count > budget) {
+            count = budget;
+        }
+        // sendfile moves at most 0x7ffff000 bytes per call,
+        // the offset is kept in the connection so the loop just resumes
+        const uint64_t started = monotonic_nanoseconds();
+        const ssize_t written =
+            sendfile(connection->fd, connection->file->fd,
+                     &connection->file_offset, count);
+        record_latency(worker, kSendfileSyscall, started);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            return would_block() ? 0 : -1;
+        }
+        if (written == 0) {
+            // the file was truncated under us
+            return -1;
+        }
+        connection->bytes_sent += written;
+        budget -= written;
+    }
+    return connection->file_offset == connection->file_end ? 1 : 0;
+}
+
+int send_body_splice(struct worker* worker, struct connection* connection) {
+    if (connection->pipe_fds[0] == -1) {
+        if (pipe2(connection->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return -1;
+        }
+        // a larger pipe means fewer splice calls, the default is 64 KiB
+        fcntl(connection->pipe_fds[1], F_SETPIPE_SZ, kPipeSize);
+    }
+
+    size_t budget = kMaxBytesPerTurn;
+    while ((connection->file_offset < connection->file_end ||
+            connection->bytes_in_pipe > 0) && budget > 0) {
+        if (connection->file_offset < connection->file_end) {
+            size_t count = connection->file_end - connection->file_offset;
+            if (count > budget) {
+                count = budget;
+            }
+            const ssize_t moved = splice(
+                connection->file->fd, &connection->file_offset,
+                connection->pipe_fds[1], NULL, count,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1 && errno != EINTR && !would_block()) {
+                return -1;
+            }
+            if (moved == 0) {
+                return -1;
+            }
+            if (moved > 0) {
+                connection->bytes_in_pipe += moved;
+            }
+        }
+
+        const int more = connection->file_offset < connection->file_end;
+        const uint64_t started = monotonic_nanoseconds();
+        const ssize_t written = splice(
+            connection->pipe_fds[0], NULL, connection->fd, NULL,
+            connection->bytes_in_pipe,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0));
+        record_latency(worker, kSpliceSyscall, started);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            return would_block() ? 0 : -1;
+        }
+        connection->bytes_sent += written;
+        connection->bytes_in_pipe -= written;
+        budget -= written;
+    }
+    return connection->file_offset == connection->file_end &&
+           connection->bytes_in_pipe == 0;
+}
+
+// Returns 1 when the response is fully sent, 0 when the socket is full
+// and -1 on error.
+int write_response(struct worker* worker, struct connection* connection) {
+    const int body_follows =
+        connection->file && connection->file_offset < connection->file_end;
+    struct msghdr message = {
+        .msg_iov = connection->response_parts,
+        .msg_iovlen = kResponseParts
+    };
+    while (response_parts_left(connection) > 0) {
+        // MSG_MORE lets the header share a segment with the body
+        const ssize_t written = sendmsg(
+            connection->fd, &message, MSG_NOSIGNAL | (body_follows ? MSG_MORE : 0));
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            return would_block() ? 0 : -1;
+        }
+        // the parts array is the message's iov, it resumes from the rest
+        advance_response_parts(connection, written);
+        connection->bytes_sent += written;
+    }
+    connection->state = kWritingBody;
+    if (connection->file == NULL || connection->file->data) {
+        return 1;
+    }
+    return options.use_splice ? send_body_splice(worker, connection)
+                              : send_body_sendfile(worker, connection);
+}
+
+// Called when the response is fully sent. Returns 1 if the connection
+// is kept for the next request and 0 if it is closed.
+int finish_response(struct worker* worker, struct connection* connection) {
+    record_response(worker, connection);
+    flush_bytes_sent(worker, connection);
+    if (!connection->keep_alive || worker->stopping) {
+        close_connection(worker, connection);
+        return 0;
+    }
+    close_file(connection);
+    connection->request_begin = connection->request_end;
+    connection->state = kReadingRequest;
+    return 1;
+}
+
+void handle_connection(struct worker* worker, struct connection* connection,
+                       const uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        fail_connection(worker, connection, kSocketError);
+        return;
+    }
+    touch_connection(worker, connection);
+
+    while (1) {
+        if (connection->state == kReadingRequest) {
+            // a pipelined request may already be in the buffer
+            ssize_t request_end = find_request_end(connection);
+            if (request_end == 0) {
+                request_end = read_request(worker, connection);
+            }
+            if (request_end == -1) {
+                close_connection(worker, connection);
+                return;
+            }
+            if (request_end == 0) {
+                if (events & EPOLLRDHUP) {
+                    // the peer will never finish this request
+                    close_connection(worker, connection);
+                } else if (set_events(worker, connection, EPOLLIN | EPOLLRDHUP) == -1) {
+                    fail_connection(worker, connection, kEpollError);
+                }
+                return;
+            }
+            connection->request_end = request_end;
+            if (connection->state == kReadingRequest) {
+                prepare_response(worker, connection);
+            }
+        }
+
+        const int result = write_response(worker, connection);
+        if (result == 0) {
+            if (set_events(worker, connection, EPOLLOUT) == -1) {
+                fail_connection(worker, connection, kEpollError);
+            }
+            return;
+        }
+        if (result == -1) {
+            fail_connection(worker, connection, kWriteError);
+            return;
+        }
+        if (!finish_response(worker, connection)) {
+            return;
+        }
+    }
+}
+
+void close_idle_connections(struct worker* worker) {
+    uint64_t expirations;
+    if (read(worker->timer_fd, &expirations, sizeof(expirations)) == -1 &&
+        !would_block()) {
+        CHECK_OR_EXIT(-1, "read timer_fd");
+    }
+
+    while (worker->connections &&
+           worker->now - worker->connections->last_activity >= options.idle_timeout) {
+        counter_add(&worker->metrics.idle_timeouts, 1);
+        close_connection(worker, worker->connections);
+    }
+}
+
+void main_loop(struct worker* worker) {
+    struct epoll_event events[kMaxEventsToRead];
+
+    while (!worker->stopping || worker->active_connections > 0) {
+        const int events_count =
+            epoll_wait(worker->epoll_fd, events, kMaxEventsToRead, -1);
+        if (events_count == -1 && errno == EINTR) {
+            continue;
+        }
+        CHECK_OR_EXIT(events_count, "epoll_wait");
+        worker->now = monotonic_seconds();
+
+        for (int i = 0; i < events_count; ++i) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &worker->signal_fd) {
+                stop_accepting(worker);
+            } else if (ptr == &worker->timer_fd) {
+                close_idle_connections(worker);
+            } else if (ptr == &worker->cache.inotify_fd) {
+                cache_handle_inotify(&worker->cache);
+            } else if (ptr == &worker->socket_fd) {
+                if (!worker->stopping) {
+                    accept_connections(worker);
+                }
+            } else {
+                handle_connection(worker, ptr, events[i].events);
+            }
+        }
+    }
+}
+
+
+#ifdef HAVE_IO_URING
+
+static const unsigned kUringEntries = 4096;
+// provided buffers for receives, shared by all connections of a worker
+static const unsigned kRecvBuffersCount = 1024;
+static const unsigned kRecvBufferSize = 4096;
+static const unsigned kRecvBufferGroup = 0;
+
+// user_data of worker operations, connection operations carry the
+// connection pointer with the operation in the low 3 bits
+enum uring_worker_operation {
+    kUringAccept = 1,
+    kUringSignal,
+    kUringTimer,
+    kUringInotify,
+    kUringCancel,
+};
+
+enum uring_connection_operation {
+    kUringRecv,
+    kUringSend,
+    kUringSpliceIn,
+    kUringSpliceOut,
+    kUringOpen,
+    kUringStatx,
+};
+
+static const uint64_t kUringOperationMask = 7;
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    // sqes filled locally and not yet passed to io_uring_enter
+    unsigned sq_local_tail;
+    unsigned sq_submitted;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring_memory;
+    size_t ring_memory_size;
+    size_t sqes_size;
+
+    // NULL when the kernel has no IORING_REGISTER_PBUF_RING
+    struct io_uring_buf_ring* buffers_ring;
+    char* buffers;
+    unsigned buffers_tail;
+};
+
+// Cache miss: openat and statx are submitted as a linked pair.
+struct open_request {
+    int watched;
+    int completions;
+    int opened;
+    int open_result;
+    int statx_result;
+    uint64_t hash;
+    size_t length;
+    struct statx statx;
+    char path[];
+};
+
+int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_init(struct uring* ring) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // the ring is set up here and used by the worker thread,
+    // so IORING_SETUP_SINGLE_ISSUER would not fit
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = uring_setup(kUringEntries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // older kernels do not know the optional flags
+        memset(&params, 0, sizeof(params));
+        ring->fd = uring_setup(kUringEntries, &params);
+    }
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_memory_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_memory = mmap(NULL, ring->ring_memory_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    CHECK_OR_EXIT((ring->ring_memory == MAP_FAILED ? -1 : 0), "mmap io_uring");
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    CHECK_OR_EXIT((ring->sqes == MAP_FAILED ? -1 : 0), "mmap io_uring sqes");
+
+    char* memory = ring->ring_memory;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned*)(memory + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(memory + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(memory + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(memory + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sq_submitted = ring->sq_local_tail;
+
+    ring->cq_head = (unsigned*)(memory + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(memory + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(memory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(memory + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_recycle_buffer(struct uring* ring, const unsigned id) {
+    struct io_uring_buf* buffer =
+        &ring->buffers_ring->bufs[ring->buffers_tail & (kRecvBuffersCount - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * kRecvBufferSize);
+    buffer->len = kRecvBufferSize;
+    buffer->bid = id;
+    ++ring->buffers_tail;
+    __atomic_store_n(&ring->buffers_ring->tail, (uint16_t)ring->buffers_tail,
+                     __ATOMIC_RELEASE);
+}
+
+// Without provided buffers receives go straight into connection buffers.
+void uring_setup_buffers(struct uring* ring) {
+    const size_t ring_size = kRecvBuffersCount * sizeof(struct io_uring_buf);
+    void* memory = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return;
+    }
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uint64_t)(uintptr_t)memory,
+        .ring_entries = kRecvBuffersCount,
+        .bgid = kRecvBufferGroup
+    };
+    ring->buffers = malloc((size_t)kRecvBuffersCount * kRecvBufferSize);
+    if (ring->buffers == NULL ||
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &registration, 1) == -1) {
+        free(ring->buffers);
+        ring->buffers = NULL;
+        munmap(memory, ring_size);
+        return;
+    }
+    ring->buffers_ring = memory;
+    for (unsigned id = 0; id < kRecvBuffersCount; ++id) {
+        uring_recycle_buffer(ring, id);
+    }
+}
+
+void uring_destroy(struct uring* ring) {
+    if (ring->buffers_ring) {
+        munmap(ring->buffers_ring, kRecvBuffersCount * sizeof(struct io_uring_buf));
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_memory, ring->ring_memory_size);
+    close(ring->fd);
+}
+
+// Passes the queued sqes to the kernel and waits for wait_for completions.
+void uring_enter(struct uring* ring, const unsigned wait_for) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        const unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+        const int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for,
+                                   wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            if (errno != EINTR && wait_for == 0) {
+                return;
+            }
+            continue;
+        }
+        CHECK_OR_EXIT(result, "io_uring_enter");
+        ring->sq_submitted += result;
+        return;
+    }
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+           ring->sq_entries) {
+        uring_enter(ring, 0);
+    }
+    const unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->sq_local_tail;
+    return sqe;
+}
+
+struct io_uring_sqe* uring_connection_sqe(struct worker* worker,
+                                          struct connection* connection,
+                                          const enum uring_connection_operation operation) {
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->ring);
+    sqe->user_data = (uint64_t)(uintptr_t)connection | operation;
+    ++connection->pending_operations;
+    return sqe;
+}
+
+void uring_submit_accept(struct worker* worker) {
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->socket_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = kUringAccept;
+}
+
+void uring_submit_poll(struct worker* worker, const int fd,
+                       const enum uring_worker_operation operation) {
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    // the signal fd is never read, one wakeup is enough for it
+    sqe->len = operation == kUringSignal ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->user_data = operation;
+}
+
+void uring_submit_recv(struct worker* worker, struct connection* connection,
+                       const int provided) {
+    struct io_uring_sqe* sqe = uring_connection_sqe(worker, connection, kUringRecv);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    if (provided && worker->ring->buffers_ring) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kRecvBufferGroup;
+        sqe->len = kRecvBufferSize;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)(connection->buffer + connection->buffer_size);
+        sqe->len = connection->buffer_capacity - connection->buffer_size;
+    }
+}
+
+void uring_submit_send(struct worker* worker, struct connection* connection) {
+    const int body_follows =
+        connection->file && connection->file_offset < connection->file_end;
+    memset(&connection->message, 0, sizeof(connection->message));
+    connection->message.msg_iov = connection->response_parts;
+    connection->message.msg_iovlen = kResponseParts;
+
+    struct io_uring_sqe* sqe = uring_connection_sqe(worker, connection, kUringSend);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&connection->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (body_follows ? MSG_MORE : 0);
+}
+
+void uring_receive(struct worker* worker, struct connection* connection);
+void uring_send_response(struct worker* worker, struct connection* connection);
+
+// The body goes file -> pipe -> socket as a linked pair of splices. A short
+// first splice cancels the second one, then whatever reached the pipe is
+// sent on its own.
+void uring_send_body(struct worker* worker, struct connection* connection) {
+    if (connection->pipe_fds[0] == -1) {
+        // the pipe is blocking: splices run in io_uring workers anyway
+        if (pipe2(connection->pipe_fds, O_CLOEXEC) == -1) {
+            fail_connection(worker, connection, kWriteError);
+            return;
+        }
+        fcntl(connection->pipe_fds[1], F_SETPIPE_SZ, kPipeSize);
+    }
+    const int more = connection->file_offset < connection->file_end;
+
+    if (connection->bytes_in_pipe == 0) {
+        const int pipe_size = fcntl(connection->pipe_fds[1], F_GETPIPE_SZ);
+        size_t count = connection->file_end - connection->file_offset;
+        if (pipe_size > 0 && count > (size_t)pipe_size) {
+            count = pipe_size;
+        }
+        struct io_uring_sqe* sqe =
+            uring_connection_sqe(worker, connection, kUringSpliceIn);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = connection->file->fd;
+        sqe->splice_off_in = connection->file_offset;
+        sqe->fd = connection->pipe_fds[1];
+        sqe->off = -1;
+        sqe->len = count;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_connection_sqe(worker, connection, kUringSpliceOut);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = connection->pipe_fds[0];
+        sqe->splice_off_in = -1;
+        sqe->fd = connection->fd;
+        sqe->off = -1;
+        sqe->len = count;
+        sqe->splice_flags = SPLICE_F_MOVE |
+            (connection->file_offset + (off_t)count < connection->file_end ? SPLICE_F_MORE : 0);
+        return;
+    }
+
+    struct io_uring_sqe* sqe = uring_connection_sqe(worker, connection, kUringSpliceOut);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = connection->pipe_fds[0];
+    sqe->splice_off_in = -1;
+    sqe->fd = connection->fd;
+    sqe->off = -1;
+    sqe->len = connection->bytes_in_pipe;
+    sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+}
+
+void uring_submit_open(struct worker* worker, struct connection* connection,
+                       const char* path, const size_t length) {
+    struct open_request* request = calloc(1, sizeof(struct open_request) + length + 2);
+    if (request == NULL) {
+        fail_connection(worker, connection, kMemoryError);
+        return;
+    }
+    request->watched = worker->cache.buckets &&
+                       cache_watch_directory(&worker->cache, path, length) == 0;
+    request->hash = hash_path(path, length);
+    request->length = length;
+    memcpy(request->path, length ? path : ".", length ? length : 1);
+    connection->open_request = request;
+
+    struct io_uring_sqe* sqe = uring_connection_sqe(worker, connection, kUringOpen);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = options.directory_fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_connection_sqe(worker, connection, kUringStatx);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = options.directory_fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->path;
+    sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    sqe->off = (uint64_t)(uintptr_t)&request->statx;
+}
+
+void uring_discard_open_request(struct connection* connection) {
+    struct open_request* request = connection->open_request;
+    if (request == NULL) {
+        return;
+    }
+    if (request->opened && request->open_result >= 0) {
+        close(request->open_result);
+    }
+    free(request);
+    connection->open_request = NULL;
+}
+
+// Both halves of the open request completed.
+void uring_opened(struct worker* worker, struct connection* connection) {
+    struct open_request* request = connection->open_request;
+    connection->open_request = NULL;
+
+    if (request->open_result < 0) {
+        respond_with_open_error(connection, -request->open_result);
+    } else if (request->statx_result < 0 || !S_ISREG(request->statx.stx_mode)) {
+        close(request->open_result);
+        prepare_header(connection, "404 Not Found", 0);
+    } else {
+        struct file_entry* file = make_file_entry(
+            &worker->cache, request->path, request->length, request->hash,
+            request->open_result, request->statx.stx_size,
+            request->statx.stx_mtime.tv_sec, request->watched);
+        if (file == NULL) {
+            free(request);
+            fail_connection(worker, connection, kMemoryError);
+            return;
+        }
+        respond_with_file(&worker->cache, connection, file);
+    }
+    free(request);
+    uring_send_response(worker, connection);
+}
+
+// A complete request is at [request_begin, request_end).
+void uring_handle_request(struct worker* worker, struct connection* connection) {
+    if (connection->state == kReadingRequest) {
+        char path[PATH_MAX];
+        const ssize_t length = parse_request(worker, connection, path, sizeof(path));
+        if (length >= 0 && !respond_with_metrics(connection, path, length)) {
+            struct file_entry* file = cache_acquire(
+                &worker->cache, path, length, hash_path(path, length));
+            if (file == NULL) {
+                uring_submit_open(worker, connection, path, length);
+                return;
+            }
+            respond_with_file(&worker->cache, connection, file);
+        }
+    }
+    uring_send_response(worker, connection);
+}
+
+// Serves the next pipelined request or waits for more bytes.
+void uring_receive(struct worker* worker, struct connection* connection) {
+    const size_t request_end = find_request_end(connection);
+    if (request_end) {
+        connection->request_end = request_end;
+        uring_handle_request(worker, connection);
+        return;
+    }
+
+    compact_request_buffer(connection);
+    const int reserved = reserve_request_buffer(connection);
+    if (reserved == -1) {
+        fail_connection(worker, connection, kMemoryError);
+        return;
+    }
+    if (reserved == 1) {
+        connection->request_end = connection->buffer_size;
+        uring_send_response(worker, connection);
+        return;
+    }
+    uring_submit_recv(worker, connection, 1);
+}
+
+void uring_send_response(struct worker* worker, struct connection* connection) {
+    if (response_parts_left(connection) > 0) {
+        uring_submit_send(worker, connection);
+        return;
+    }
+    connection->state = kWritingBody;
+    if (connection->file && (connection->file_offset < connection->file_end ||
+                             connection->bytes_in_pipe > 0)) {
+        uring_send_body(worker, connection);
+        return;
+    }
+    if (finish_response(worker, connection)) {
+        uring_receive(worker, connection);
+    }
+}
+
+void uring_handle_connection(struct worker* worker, struct connection* connection,
+                             const enum uring_connection_operation operation,
+                             const int result, const uint32_t flags) {
+    if ((flags & IORING_CQE_F_BUFFER) && result > 0 && connection->closing) {
+        uring_recycle_buffer(worker->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    --connection->pending_operations;
+    if (connection->closing) {
+        if (operation == kUringOpen) {
+            connection->open_request->opened = 1;
+            connection->open_request->open_result = result;
+        }
+        if (connection->pending_operations == 0) {
+            uring_discard_open_request(connection);
+            free_connection(connection);
+            --worker->closing_connections;
+        }
+        return;
+    }
+    touch_connection(worker, connection);
+
+    switch (operation) {
+    case kUringRecv:
+        if (result == -ENOBUFS) {
+            // all provided buffers are in use, receive into our own one
+            uring_submit_recv(worker, connection, 0);
+            return;
+        }
+        if (result < 0) {
+            fail_connection(worker, connection, kReadError);
+            return;
+        }
+        if (result == 0) {
+            close_connection(worker, connection);
+            return;
+        }
+        if (flags & IORING_CQE_F_BUFFER) {
+            const unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+            const char* data = worker->ring->buffers + (size_t)id * kRecvBufferSize;
+            size_t copied = 0;
+            while (copied < (size_t)result) {
+                if (reserve_request_buffer(connection) != 0) {
+                    // too large requests are rejected, like with epoll
+                    break;
+                }
+                size_t step = connection->buffer_capacity - connection->buffer_size;
+                if (step > result - copied) {
+                    step = result - copied;
+                }
+                memcpy(connection->buffer + connection->buffer_size, data + copied, step);
+                connection->buffer_size += step;
+                copied += step;
+            }
+            uring_recycle_buffer(worker->ring, id);
+            if (connection->state != kReadingRequest) {
+                connection->request_end = connection->buffer_size;
+                uring_send_response(worker, connection);
+                return;
+            }
+            if (copied < (size_t)result) {
+                fail_connection(worker, connection, kMemoryError);
+                return;
+            }
+        } else {
+            connection->buffer_size += result;
+        }
+        uring_receive(worker, connection);
+        return;
+
+    case kUringSend: {
+        if (result < 0) {
+            fail_connection(worker, connection, kWriteError);
+            return;
+        }
+        advance_response_parts(connection, result);
+        connection->bytes_sent += result;
+        uring_send_response(worker, connection);
+        return;
+    }
+
+    case kUringSpliceIn:
+        if (result <= 0) {
+            // zero means the file was truncated under us
+            connection->body_failed = 1;
+            return;
+        }
+        connection->file_offset += result;
+        connection->bytes_in_pipe += result;
+        return;
+
+    case kUringSpliceOut:
+        if (result == -ECANCELED && !connection->body_failed) {
+            // the first splice was short, send what it moved
+            uring_send_response(worker, connection);
+            return;
+        }
+        if (result <= 0) {
+            fail_connection(worker, connection, kWriteError);
+            return;
+        }
+        connection->bytes_in_pipe -= result;
+        connection->bytes_sent += result;
+        uring_send_response(worker, connection);
+        return;
+
+    case kUringOpen:
+        connection->open_request->opened = 1;
+        connection->open_request->open_result = result;
+        if (++connection->open_request->completions == 2) {
+            uring_opened(worker, connection);
+        }
+        return;
+
+    case kUringStatx:
+        connection->open_request->statx_result = result;
+        if (++connection->open_request->completions == 2) {
+            uring_opened(worker, connection);
+        }
+        return;
+    }
+}
+
+void uring_stop_accepting(struct worker* worker) {
+    if (worker->stopping) {
+        return;
+    }
+    worker->stopping = 1;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(worker->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = kUringAccept;
+    sqe->user_data = kUringCancel;
+    close(worker->socket_fd);
+    worker->socket_fd = -1;
+    close_waiting_connections(worker);
+}
+
+void uring_handle_worker(struct worker* worker,
+                         const enum uring_worker_operation operation,
+                         const int result, const uint32_t flags) {
+    switch (operation) {
+    case kUringAccept:
+        if (result >= 0) {
+            struct connection* connection = add_connection(worker, result);
+            if (connection && worker->stopping) {
+                close_connection(worker, connection);
+            } else if (connection) {
+                uring_receive(worker, connection);
+            }
+        } else if (result != -ECANCELED) {
+            record_error(worker, kAcceptError);
+        }
+        if (!(flags & IORING_CQE_F_MORE) && !worker->stopping) {
+            uring_submit_accept(worker);
+        }
+        return;
+
+    case kUringSignal:
+        uring_stop_accepting(worker);
+        return;
+
+    case kUringTimer:
+        close_idle_connections(worker);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            uring_submit_poll(worker, worker->timer_fd, kUringTimer);
+        }
+        return;
+
+    case kUringInotify:
+        cache_handle_inotify(&worker->cache);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            uring_submit_poll(worker, worker->cache.inotify_fd, kUringInotify);
+        }
+        return;
+
+    case kUringCancel:
+        return;
+    }
+}
+
+void uring_main_loop(struct worker* worker) {
+    struct uring* ring = worker->ring;
+    uring_submit_accept(worker);
+    uring_submit_poll(worker, worker->signal_fd, kUringSignal);
+    uring_submit_poll(worker, worker->timer_fd, kUringTimer);
+    if (worker->cache.inotify_fd != -1) {
+        uring_submit_poll(worker, worker->cache.inotify_fd, kUringInotify);
+    }
+
+    while (!worker->stopping || worker->active_connections > 0 ||
+           worker->closing_connections > 0) {
+        uring_enter(ring, 1);
+        worker->now = monotonic_seconds();
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            // hand the slot back before handling, handlers submit new work
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+            struct connection* connection =
+                (struct connection*)(uintptr_t)(cqe.user_data & ~kUringOperationMask);
+            if (connection == NULL) {
+                uring_handle_worker(worker, cqe.user_data, cqe.res, cqe.flags);
+            } else {
+                uring_handle_connection(worker, connection,
+                                        cqe.user_data & kUringOperationMask,
+                                        cqe.res, cqe.flags);
+            }
+        }
+    }
+}
+
+#endif // HAVE_IO_URING
+
+void* worker_routine(void* argument) {
+    struct worker* worker = argument;
+#ifdef HAVE_IO_URING
+    if (worker->ring) {
+        uring_main_loop(worker);
+        uring_destroy(worker->ring);
+        free(worker->ring);
+    } else {
+        main_loop(worker);
+    }
+#else
+    main_loop(worker);
+#endif
+    cache_clear(&worker->cache);
+    if (worker->cache.inotify_fd != -1) {
+        close(worker->cache.inotify_fd);
+    }
+    for (int i = 0; i < worker->cache.watched_directories_capacity; ++i) {
+        free(worker->cache.watched_directories[i]);
+    }
+    free(worker->cache.watched_directories);
+    free(worker->cache.buckets);
+    close(worker->timer_fd);
+    if (worker->epoll_fd != -1) {
+        close(worker->epoll_fd);
+    }
+    return NULL;
+}
+
+void parse_options(int argc, char** argv) {
+    const struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"idle-timeout", required_argument, NULL, 't'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"splice", no_argument, NULL, 's'},
+        {"backend", required_argument, NULL, 'b'},
+        {"benchmark", required_argument, NULL, 'B'},
+        {"clients", required_argument, NULL, 'C'},
+        {"gzip", no_argument, NULL, 'z'},
+        {"gzip-cache-size", required_argument, NULL, 'Z'},
+        {"metrics-path", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "w:kt:c:sb:B:C:zZ:m:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'w':
+            options.workers_count = atoi(optarg);
+            if (options.workers_count == 0) {
+                options.workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 'k':
+            options.keep_alive = 1;
+            break;
+        case 't':
+            options.idle_timeout = atoi(optarg);
+            break;
+        case 'c':
+            options.cache_capacity = atoi(optarg);
+            break;
+        case 's':
+            options.use_splice = 1;
+            break;
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0) {
+                options.backend = kEpollBackend;
+#ifdef HAVE_IO_URING
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                options.backend = kUringBackend;
+#endif
+            } else {
+                fprintf(stderr, "unsupported backend: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            options.benchmark_requests = atoi(optarg);
+            break;
+        case 'C':
+            options.benchmark_clients = atoi(optarg);
+            break;
+        case 'z':
+            options.gzip = 1;
+            break;
+        case 'Z':
+            options.gzip_cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'm':
+            // "" disables the endpoint
+            while (*optarg == '/') {
+                ++optarg;
+            }
+            options.metrics_path = *optarg ? optarg : NULL;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s PORT DIRECTORY [--workers N] [--keep-alive]"
+                    " [--idle-timeout SECONDS] [--cache-size ENTRIES] [--splice]"
+                    " [--backend epoll|io_uring] [--gzip [--gzip-cache-size MIB]]"
+                    " [--metrics-path PATH]"
+                    " [--benchmark REQUESTS [--clients N]]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    assert(argc - optind == 2);
+    assert(options.workers_count > 0 && options.workers_count <= kMaxWorkers);
+    assert(options.idle_timeout > 0);
+    assert(options.cache_capacity >= 0);
+    assert(options.benchmark_requests >= 0 && options.benchmark_clients > 0);
+
+    sscanf(argv[optind], "%d", &options.port_number);
+    options.path_to_directory = argv[optind + 1];
+
+    options.directory_fd = open(options.path_to_directory, O_PATH | O_DIRECTORY);
+    CHECK_OR_EXIT(options.directory_fd, "open directory");
+}
+
+void serve() {
+    // sendfile has no MSG_NOSIGNAL, a client that went away must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    const int signal_fd = make_signal_fd();
+
+    workers = calloc(options.workers_count, sizeof(struct worker));
+    assert(workers != NULL);
+    workers_count = options.workers_count;
+
+    // all sockets are bound before the first worker starts,
+    // so a bind error is reported before any connection is accepted
+    for (int i = 0; i < options.workers_count; ++i) {
+        struct worker* worker = &workers[i];
+        worker->epoll_fd = -1;
+        worker->signal_fd = signal_fd;
+        worker->socket_fd =
+            create_socket(options.port_number, options.backend == kEpollBackend);
+        worker->timer_fd = make_timer_fd();
+        worker->now = monotonic_seconds();
+        cache_init(&worker->cache);
+
+#ifdef HAVE_IO_URING
+        if (options.backend == kUringBackend) {
+            worker->ring = calloc(1, sizeof(struct uring));
+            assert(worker->ring != NULL);
+            CHECK_OR_EXIT(uring_init(worker->ring), "io_uring_setup");
+            uring_setup_buffers(worker->ring);
+            continue;
+        }
+#endif
+        worker->epoll_fd = make_epoll();
+        register_fd(worker->epoll_fd, &worker->signal_fd, EPOLLIN);
+        register_fd(worker->epoll_fd, &worker->socket_fd, EPOLLIN);
+        register_fd(worker->epoll_fd, &worker->timer_fd, EPOLLIN);
+        if (worker->cache.inotify_fd != -1) {
+            register_fd(worker->epoll_fd, &worker->cache.inotify_fd, EPOLLIN);
+        }
+    }
+
+    for (int i = 0; i < options.workers_count; ++i) {
+        const int error =
+            pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+        if (error) {
+            errno = error;
+            perror("pthread_create");
+            exit(errno);
+        }
+    }
+    for (int i = 0; i < options.workers_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    workers = NULL;
+    workers_count = 0;
+    close(signal_fd);
+}
+
+struct benchmark {
+    char** files;
+    int files_count;
+    // requests left to start, shared by all clients
+    int requests_left;
+    uint64_t bytes_received;
+    int failures;
+};
+
+int benchmark_connect() {
+    const struct sockaddr_in addr_in = {
+        .sin_family = AF_INET,
+        .sin_port = htons(options.port_number),
+        .sin_addr.s_addr = inet_addr("127.0.0.1")
+    };
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (const struct sockaddr*)&addr_in, sizeof(addr_in)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request and reads the whole response.
+// Returns the number of body bytes or -1.
+ssize_t benchmark_request(const int fd, const char* file) {
+    char buffer[64 * 1024];
+    const int request_size = snprintf(
+        buffer, sizeof(buffer), "GET /%s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", file,
+        options.keep_alive ? "" : "Connection: close\r\n");
+    if (send(fd, buffer, request_size, MSG_NOSIGNAL) != request_size) {
+        return -1;
+    }
+
+    size_t size = 0;
+    char* header_end = NULL;
+    while (header_end == NULL) {
+        const ssize_t amount_of_read = read(fd, buffer + size, sizeof(buffer) - 1 - size);
+        if (amount_of_read <= 0) {
+            return -1;
+        }
+        size += amount_of_read;
+        buffer[size] = '\0';
+        header_end = strstr(buffer, "\r\n\r\n");
+    }
+    long long content_length = 0;
+    const char* length_header = strcasestr(buffer, "Content-Length:");
+    if (length_header) {
+        sscanf(length_header + 15, "%lld", &content_length);
+    }
+
+    long long body_left = content_length - (long long)(size - (header_end + 4 - buffer));
+    while (body_left > 0) {
+        const ssize_t amount_of_read =
+            read(fd, buffer, body_left < (long long)sizeof(buffer) ? (size_t)body_left : sizeof(buffer));
+        if (amount_of_read <= 0) {
+            return -1;
+        }
+        body_left -= amount_of_read;
+    }
+    return content_length;
+}
+
+void* benchmark_client(void* argument) {
+    struct benchmark* benchmark = argument;
+    int fd = -1;
+    while (1) {
+        const int request = __atomic_sub_fetch(&benchmark->requests_left, 1, __ATOMIC_RELAXED);
+        if (request < 0) {
+            break;
+        }
+        if (fd == -1 && (fd = benchmark_connect()) == -1) {
+            __atomic_add_fetch(&benchmark->failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        const ssize_t received =
+            benchmark_request(fd, benchmark->files[request % benchmark->files_count]);
+        if (received == -1) {
+            __atomic_add_fetch(&benchmark->failures, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&benchmark->bytes_received, received, __ATOMIC_RELAXED);
+        }
+        if (received == -1 || !options.keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return NULL;
+}
+
+double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Serves the directory with the given backend in a child process and
+// fires options.benchmark_requests requests at it.
+void benchmark_backend(const enum backend backend, const char* name,
+                       char** files, const int files_count) {
+    // the child must not flush a copy of our buffered output
+    fflush(stdout);
+    const pid_t pid = fork();
+    CHECK_OR_EXIT(pid, "fork");
+    if (pid == 0) {
+        options.backend = backend;
+        serve();
+        exit(EXIT_SUCCESS);
+    }
+
+    // wait until the server listens
+    int fd = -1;
+    for (int attempt = 0; attempt < 100 && (fd = benchmark_connect()) == -1; ++attempt) {
+        usleep(10000);
+    }
+    CHECK_OR_EXIT(fd, "connect");
+    close(fd);
+
+    struct benchmark benchmark = {
+        .files = files,
+        .files_count = files_count,
+        .requests_left = options.benchmark_requests
+    };
+    pthread_t* clients = calloc(options.benchmark_clients, sizeof(pthread_t));
+    assert(clients != NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < options.benchmark_clients; ++i) {
+        const int error = pthread_create(&clients[i], NULL, benchmark_client, &benchmark);
+        if (error) {
+            errno = error;
+            perror("pthread_create");
+            exit(errno);
+        }
+    }
+    for (int i = 0; i < options.benchmark_clients; ++i) {
+        pthread_join(clients[i], NULL);
+    }
+    const double seconds = seconds_since(&start);
+    free(clients);
+
+    kill(pid, SIGTERM);
+    CHECK_OR_EXIT(waitpid(pid, NULL, 0), "waitpid");
+
+    printf("%-9s %10d requests %8.3f s %12.0f req/s %10.1f MiB/s %6d failed\n",
+           name, options.benchmark_requests, seconds,
+           options.benchmark_requests / seconds,
+           benchmark.bytes_received / seconds / (1024 * 1024), benchmark.failures);
+    fflush(stdout);
+}
+
+// Compares the backends on the regular files at the top of the directory.
+void benchmark() {
+    DIR* directory = opendir(options.path_to_directory);
+    assert(directory != NULL);
+
+    char** files = NULL;
+    int files_count = 0;
+    for (struct dirent* entry; (entry = readdir(directory)) != NULL;) {
+        struct stat stat;
+        if (fstatat(dirfd(directory), entry->d_name, &stat, 0) == 0 &&
+            S_ISREG(stat.st_mode)) {
+            files = realloc(files, (files_count + 1) * sizeof(char*));
+            assert(files != NULL);
+            files[files_count++] = strdup(entry->d_name);
+        }
+    }
+    closedir(directory);
+    if (files_count == 0) {
+        fprintf(stderr, "no regular files in %s\n", options.path_to_directory);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d files, %d workers, %d clients, %s\n", files_count,
+           options.workers_count, options.benchmark_clients,
+           options.keep_alive ? "keep-alive" : "connection per request");
+    benchmark_backend(kEpollBackend, "epoll", files, files_count);
+#ifdef HAVE_IO_URING
+    benchmark_backend(kUringBackend, "io_uring", files, files_count);
+#endif
+
+    for (int i = 0; i < files_count; ++i) {
+        free(files[i]);
+    }
+    free(files);
+}
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+
+    if (options.benchmark_requests > 0) {
+        benchmark();
+    } else {
+        serve();
+    }
+
+    close(options.directory_fd);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,568 @@
+// A mock DNS server to benchmark 22-2.c offline: it answers A queries from
+// a zone file, late and not always, as told.
+// gcc 22-2-mock.c -o mock
+// ./mock hosts.txt & # 127.0.0.1:5353, answers at once
+// ./mock -P 5354 -l 5 -j 20 -d 0.01 -t 60 zone.txt & # 5 ms + up to 20 ms late, 1% lost, TTL 60
+// ./resolver -S 127.0.0.1:5353,127.0.0.1:5354 < hosts.txt
+//
+// A zone line is a name followed by its addresses, or by the name it is an
+// alias of. A name alone, as in hosts.txt, gets an address made from its
+// hash. Names not in the zone are NXDOMAIN and other types are NODATA, both
+// with an SOA. Responses wait in a heap ordered by the time they are due,
+// datagrams are received and sent in batches through recvmmsg and sendmmsg.
+// SIGINT or SIGTERM prints the counters and stops the server.
+
+#define _GNU_SOURCE // sendmmsg, recvmmsg, ppoll
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define CHECK_ON_ERROR(WHAT_TO_CHECK, ERROR) \
+    if (WHAT_TO_CHECK == -1) {               \
+        perror(ERROR);                       \
+        exit(errno);                         \
+    }
+
+#define MAX_SIZE 4096
+#define MAX_RESPONSE_SIZE 512 // a UDP DNS message without EDNS
+#define NAME_SIZE 256 // a dotted name with the terminating zero
+#define MAX_ADDRESSES 16
+#define MAX_CNAME_HOPS 8
+#define BATCH_SIZE 64 // datagrams per sendmmsg or recvmmsg
+#define DEFAULT_PORT 5353
+#define DEFAULT_TTL 300
+#define RECEIVE_BUFFER_SIZE (4 << 20)
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_NOTIMP 4
+
+struct zone_entry {
+    char* name; // lowercase, without the trailing dot
+    char* alias; // or NULL
+    int addresses_count;
+    uint32_t addresses[MAX_ADDRESSES]; // network order
+    struct zone_entry* next;
+};
+
+// A response waiting for its time.
+struct pending {
+    uint64_t due_us;
+    struct sockaddr_in address;
+    uint16_t size;
+    uint8_t packet[MAX_RESPONSE_SIZE];
+};
+
+// A response being built, put_* fail once it is full.
+struct response {
+    uint8_t* packet;
+    size_t size;
+};
+
+static struct zone_entry** zone;
+static size_t zone_buckets_count;
+
+static struct pending* heap;
+static size_t heap_size;
+static size_t heap_capacity;
+
+static int socket_fd;
+static uint64_t latency_us;
+static uint64_t jitter_us;
+static double loss;
+static uint32_t ttl = DEFAULT_TTL;
+
+static struct mmsghdr receive_batch[BATCH_SIZE];
+static struct iovec receive_vectors[BATCH_SIZE];
+static struct sockaddr_in receive_addresses[BATCH_SIZE];
+static uint8_t receive_buffers[BATCH_SIZE][MAX_SIZE];
+static struct mmsghdr send_batch[BATCH_SIZE];
+static struct iovec send_vectors[BATCH_SIZE];
+static struct pending send_pending[BATCH_SIZE];
+static int send_batch_count;
+
+static size_t received_count;
+static size_t dropped_count;
+static size_t sent_count;
+static size_t negative_count;
+
+static volatile sig_atomic_t stopped;
+
+uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Lowercase, trailing dots dropped.
+void normalize_name(char* name) {
+    size_t length = 0;
+    for (; name[length] != '\0'; ++length) {
+        name[length] = tolower((unsigned char)name[length]);
+    }
+    while (length > 0 && name[length - 1] == '.') {
+        --length;
+    }
+    name[length] = '\0';
+}
+
+uint64_t hash_name(const char* name) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *name != '\0'; ++name) {
+        hash = (hash ^ (uint8_t)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct zone_entry* zone_find(const char* name) {
+    struct zone_entry* entry = zone[hash_name(name) & (zone_buckets_count - 1)];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+void read_zone(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(errno);
+    }
+    zone_buckets_count = 1 << 16;
+    zone = calloc(zone_buckets_count, sizeof(struct zone_entry*));
+    if (zone == NULL) {
+        perror("calloc");
+        exit(errno);
+    }
+    char* line = NULL;
+    size_t line_capacity = 0;
+    size_t entries_count = 0;
+    while (getline(&line, &line_capacity, file) != -1) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char* name = strtok(line, " \t\r\n");
+        if (name == NULL || strlen(name) >= NAME_SIZE) {
+            continue;
+        }
+        normalize_name(name);
+        if (zone_find(name) != NULL) {
+            fprintf(stderr, "%s: %s is repeated, the first one is used\n", path, name);
+            continue;
+        }
+        struct zone_entry* entry = calloc(1, sizeof(struct zone_entry));
+        if (entry == NULL) {
+            perror("calloc");
+            exit(errno);
+        }
+        entry->name = strdup(name);
+        for (char* value = strtok(NULL, " \t\r\n"); value != NULL; value = strtok(NULL, " \t\r\n")) {
+            uint32_t address;
+            if (inet_pton(AF_INET, value, &address) == 1) {
+                if (entry->addresses_count < MAX_ADDRESSES) {
+                    entry->addresses[entry->addresses_count++] = address;
+                }
+            } else if (entry->alias == NULL && strlen(value) < NAME_SIZE) {
+                normalize_name(value);
+                entry->alias = strdup(value);
+            }
+        }
+        if (entry->alias != NULL) {
+            entry->addresses_count = 0;
+        } else if (entry->addresses_count == 0) {
+            const uint32_t address = (uint32_t)hash_name(name);
+            memcpy(&entry->addresses[entry->addresses_count++], &address, sizeof(address));
+        }
+        struct zone_entry** bucket = &zone[hash_name(name) & (zone_buckets_count - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        ++entries_count;
+    }
+    free(line);
+    fclose(file);
+    fprintf(stderr, "%zu names in %s\n", entries_count, path);
+}
+
+bool put(struct response* response, const void* data, size_t size) {
+    if (response->size + size > MAX_RESPONSE_SIZE) {
+        return false;
+    }
+    memcpy(response->packet + response->size, data, size);
+    response->size += size;
+    return true;
+}
+
+bool put_uint16(struct response* response, uint16_t value) {
+    const uint8_t data[] = {value >> 8, value & 0xFF};
+    return put(response, data, sizeof(data));
+}
+
+bool put_uint32(struct response* response, uint32_t value) {
+    return put_uint16(response, value >> 16) && put_uint16(response, value & 0xFFFF);
+}
+
+// A name as labels, not compressed.
+bool put_name(struct response* response, const char* name) {
+    while (*name != '\0') {
+        const char* dot = strchr(name, '.');
+        const size_t length = dot == NULL ? strlen(name) : (size_t)(dot - name);
+        if (length == 0 || length > 63) {
+            return false;
+        }
+        const uint8_t label = length;
+        if (!put(response, &label, 1) || !put(response, name, length)) {
+            return false;
+        }
+        name += length + (dot != NULL);
+    }
+    const uint8_t root = 0;
+    return put(response, &root, 1);
+}
+
+// The head of a record owned by the name at owner_offset.
+bool put_record(struct response* response, size_t owner_offset, uint16_t type, uint16_t length) {
+    return put_uint16(response, 0xC000 | owner_offset) && put_uint16(response, type) &&
+        put_uint16(response, DNS_CLASS_IN) && put_uint32(response, ttl) &&
+        put_uint16(response, length);
+}
+
+bool put_soa(struct response* response) {
+    const uint8_t root = 0;
+    const size_t length_offset = response->size + 9;
+    if (!put(response, &root, 1) || !put_uint16(response, DNS_TYPE_SOA) ||
+        !put_uint16(response, DNS_CLASS_IN) || !put_uint32(response, ttl) ||
+        !put_uint16(response, 0)) {
+        return false;
+    }
+    const size_t data_offset = response->size;
+    if (!put_name(response, "ns.mock") || !put_name(response, "hostmaster.mock") ||
+        !put_uint32(response, 1) || !put_uint32(response, 3600) ||
+        !put_uint32(response, 600) || !put_uint32(response, 86400) ||
+        !put_uint32(response, ttl)) { // the negative TTL
+        return false;
+    }
+    const uint16_t length = response->size - data_offset;
+    response->packet[length_offset] = length >> 8;
+    response->packet[length_offset + 1] = length & 0xFF;
+    return true;
+}
+
+// Reads an uncompressed question name as lowercase dotted text.
+bool read_question_name(const uint8_t* packet, size_t size, size_t* offset, char* name) {
+    size_t length = 0;
+    while (*offset < size) {
+        const uint8_t label = packet[(*offset)++];
+        if (label == 0) {
+            name[length] = '\0';
+            return true;
+        }
+        if (label > 63 || *offset + label > size || length + label + 1 >= NAME_SIZE) {
+            return false;
+        }
+        if (length > 0) {
+            name[length++] = '.';
+        }
+        for (int i = 0; i < label; ++i) {
+            name[length++] = tolower(packet[(*offset)++]);
+        }
+    }
+    return false;
+}
+
+// Builds the response to a query, returns its size or 0 to stay silent.
+size_t make_response(const uint8_t* query, size_t query_size, uint8_t* packet) {
+    if (query_size < 12 || (query[2] & 0x80)) {
+        return 0; // not a query
+    }
+    struct response response = {.packet = packet};
+    put(&response, query, 12);
+    packet[2] = 0x80 | (query[2] & 0x79) | 0x04; // QR, the opcode and RD kept, AA
+    packet[3] = 0x80; // RA
+    memset(packet + 6, 0, 6); // no records yet
+
+    char name[NAME_SIZE];
+    size_t offset = 12;
+    const int opcode = (query[2] >> 3) & 0x0F;
+    if (query[4] != 0 || query[5] != 1 || !read_question_name(query, query_size, &offset, name) ||
+        offset + 4 > query_size) {
+        packet[3] |= DNS_RCODE_FORMERR;
+        memset(packet + 4, 0, 2);
+        return response.size;
+    }
+    const uint16_t type = query[offset] << 8 | query[offset + 1];
+    const uint16_t class = query[offset + 2] << 8 | query[offset + 3];
+    put(&response, query + 12, offset + 4 - 12); // the question as it was
+    if (opcode != 0 || class != DNS_CLASS_IN) {
+        packet[3] |= DNS_RCODE_NOTIMP;
+        return response.size;
+    }
+
+    // the CNAME chain, every owner after the first one points to the
+    // target of the previous record
+    uint16_t answers = 0;
+    size_t owner_offset = 12;
+    const struct zone_entry* entry = zone_find(name);
+    if (entry == NULL) {
+        packet[3] |= DNS_RCODE_NXDOMAIN;
+    }
+    // a record that does not fit is cut off with TC set
+    bool complete = true;
+    size_t record_offset = response.size;
+    for (int hops = 0; entry != NULL && entry->alias != NULL && hops < MAX_CNAME_HOPS; ++hops) {
+        record_offset = response.size;
+        const size_t length_offset = record_offset + 10;
+        const bool written = put_record(&response, owner_offset, DNS_TYPE_CNAME, 0);
+        const size_t target_offset = response.size;
+        if (!written || !put_name(&response, entry->alias)) {
+            complete = false;
+            break;
+        }
+        const uint16_t length = response.size - target_offset;
+        packet[length_offset] = length >> 8;
+        packet[length_offset + 1] = length & 0xFF;
+        ++answers;
+        owner_offset = target_offset;
+        entry = zone_find(entry->alias);
+    }
+    if (complete && entry != NULL && entry->alias == NULL &&
+        (type == DNS_TYPE_A || type == DNS_TYPE_ANY)) {
+        for (int i = 0; i < entry->addresses_count; ++i) {
+            record_offset = response.size;
+            if (!put_record(&response, owner_offset, DNS_TYPE_A, 4) ||
+                !put(&response, &entry->addresses[i], 4)) {
+                complete = false;
+                break;
+            }
+            ++answers;
+        }
+    }
+    if (!complete) {
+        packet[2] |= 0x02; // TC
+        response.size = record_offset;
+    }
+    packet[6] = answers >> 8;
+    packet[7] = answers & 0xFF;
+    if (complete && answers == 0 && put_soa(&response)) {
+        packet[9] = 1; // NSCOUNT
+        ++negative_count;
+    }
+    return response.size;
+}
+
+void heap_push(const struct pending* pending) {
+    if (heap_size == heap_capacity) {
+        heap_capacity = heap_capacity == 0 ? 1024 : heap_capacity * 2;
+        heap = realloc(heap, heap_capacity * sizeof(struct pending));
+        if (heap == NULL) {
+            perror("realloc");
+            exit(errno);
+        }
+    }
+    size_t index = heap_size++;
+    while (index > 0 && heap[(index - 1) / 2].due_us > pending->due_us) {
+        heap[index] = heap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    heap[index] = *pending;
+}
+
+void heap_pop(struct pending* top) {
+    *top = heap[0];
+    const struct pending last = heap[--heap_size];
+    size_t index = 0;
+    while (true) {
+        size_t child = index * 2 + 1;
+        if (child >= heap_size) {
+            break;
+        }
+        if (child + 1 < heap_size && heap[child + 1].due_us < heap[child].due_us) {
+            ++child;
+        }
+        if (heap[child].due_us >= last.due_us) {
+            break;
+        }
+        heap[index] = heap[child];
+        index = child;
+    }
+    if (heap_size > 0) {
+        heap[index] = last;
+    }
+}
+
+// What the socket cannot take now is lost, as it would be on the way.
+void flush_sends() {
+    for (int sent = 0; sent < send_batch_count;) {
+        const int result = sendmmsg(socket_fd, send_batch + sent, send_batch_count - sent, 0);
+        if (result != -1) {
+            sent += result;
+            sent_count += result;
+        } else if (errno == EAGAIN || errno == ENOBUFS) {
+            dropped_count += send_batch_count - sent;
+            break;
+        } else if (errno != EINTR) {
+            perror("sendmmsg");
+            ++sent;
+        }
+    }
+    send_batch_count = 0;
+}
+
+void send_due(uint64_t now) {
+    while (heap_size > 0 && heap[0].due_us <= now) {
+        if (send_batch_count == BATCH_SIZE) {
+            flush_sends();
+        }
+        const int index = send_batch_count++;
+        struct pending* pending = &send_pending[index];
+        heap_pop(pending);
+        send_vectors[index] = (struct iovec){pending->packet, pending->size};
+        send_batch[index].msg_hdr = (struct msghdr){
+            .msg_name = &pending->address,
+            .msg_namelen = sizeof(pending->address),
+            .msg_iov = &send_vectors[index],
+            .msg_iovlen = 1,
+        };
+    }
+    flush_sends();
+}
+
+void receive_queries() {
+    while (true) {
+        for (int i = 0; i < BATCH_SIZE; ++i) {
+            receive_vectors[i].iov_base = receive_buffers[i];
+            receive_vectors[i].iov_len = MAX_SIZE;
+            receive_batch[i].msg_hdr = (struct msghdr){
+                .msg_name = &receive_addresses[i],
+                .msg_namelen = sizeof(receive_addresses[i]),
+                .msg_iov = &receive_vectors[i],
+                .msg_iovlen = 1,
+            };
+        }
+        const int received = recvmmsg(socket_fd, receive_batch, BATCH_SIZE, 0, NULL);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            CHECK_ON_ERROR(received, "recvmmsg");
+        }
+        const uint64_t now = now_us();
+        for (int i = 0; i < received; ++i) {
+            ++received_count;
+            if (loss > 0 && random() < loss * RAND_MAX) {
+                ++dropped_count;
+                continue;
+            }
+            struct pending pending = {.address = receive_addresses[i]};
+            pending.size = make_response(receive_buffers[i], receive_batch[i].msg_len, pending.packet);
+            if (pending.size == 0) {
+                continue;
+            }
+            pending.due_us = now + latency_us + (jitter_us > 0 ? random() % (jitter_us + 1) : 0);
+            heap_push(&pending);
+        }
+        if (received < BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+void stop(int signal_number) {
+    (void)signal_number;
+    stopped = 1;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-P PORT] [-l LATENCY_MS] [-j JITTER_MS] [-d LOSS] [-t TTL] ZONE\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    int port = DEFAULT_PORT;
+    int option;
+    while ((option = getopt(argc, argv, "P:l:j:d:t:")) != -1) {
+        switch (option) {
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'l':
+            latency_us = atof(optarg) * 1000;
+            break;
+        case 'j':
+            jitter_us = atof(optarg) * 1000;
+            break;
+        case 'd':
+            loss = atof(optarg);
+            break;
+        case 't':
+            ttl = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || port <= 0 || port > UINT16_MAX || loss < 0 || loss > 1) {
+        print_usage(argv[0]);
+    }
+    read_zone(argv[optind]);
+    srandom(now_us());
+
+    struct sockaddr_in addr_in = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    CHECK_ON_ERROR(socket_fd, "socket");
+    // losses should be only the asked ones, a smaller buffer is fine too
+    const int receive_buffer_size = RECEIVE_BUFFER_SIZE;
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size));
+    CHECK_ON_ERROR(bind(socket_fd, (const struct sockaddr*)&addr_in, sizeof(addr_in)), "bind");
+
+    // no SA_RESTART, so ppoll returns at once
+    struct sigaction action = {.sa_handler = stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!stopped) {
+        struct timespec timeout;
+        struct timespec* timeout_pointer = NULL;
+        if (heap_size > 0) {
+            const uint64_t now = now_us();
+            const uint64_t wait_us = heap[0].due_us > now ? heap[0].due_us - now : 0;
+            timeout = (struct timespec){wait_us / 1000000, wait_us % 1000000 * 1000};
+            timeout_pointer = &timeout;
+        }
+        struct pollfd poll_fd = {.fd = socket_fd, .events = POLLIN};
+        if (ppoll(&poll_fd, 1, timeout_pointer, NULL) == -1 && errno != EINTR) {
+            perror("ppoll");
+            exit(errno);
+        }
+        receive_queries();
+        send_due(now_us());
+    }
+
+    fprintf(stderr, "%zu queries, %zu dropped, %zu responses sent, %zu of them negative\n",
+            received_count, dropped_count, sent_count, negative_count);
+    close(socket_fd);
+    exit(EXIT_SUCCESS);
+}
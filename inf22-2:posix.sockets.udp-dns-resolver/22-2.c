@@ -21,15 +21,47 @@
 // dig @8.8.8.8 ejudge.atp-fivt.org
 // DNS primarily uses the User Datagram Protocol (UDP) on port number 53 to serve requests.
 // https://habr.com/ru/post/478652/
+// gcc 22-2.c -o resolver
+// ./resolver < hosts.txt
+// ./resolver 127.0.0.1:5353 512 < hosts.txt # servers, queries in flight (256)
+// ./resolver -p -S 127.0.0.1:5353,127.0.0.1:5354 < hosts.txt # all servers at once, stats
+// gcc 22-2-mock.c -o mock && ./mock -l 5 -j 20 -d 0.01 hosts.txt # a server to test against
+
+// All names are read first, then up to max_in_flight queries are kept in
+// flight over one socket. A query goes to the upstream servers in turn,
+// every retransmission to the next one, or with -p to all of them at once,
+// the first response wins. Datagrams are sent and received in batches of
+// BATCH_SIZE through sendmmsg and recvmmsg, and only those from the
+// servers are looked at. Every query gets a transaction ID no
+// other query in flight has, a response is taken only if its ID and its
+// question match. A timer wheel with TICK_MS ticks retransmits a query
+// after its timeout, doubled on every attempt, and gives up after
+// MAX_ATTEMPTS. Results are printed in input order as soon as all the names
+// before them are resolved; a name that failed prints an empty line.
+//
+// Responses are parsed with bounds checks: RCODE, TC, compressed names,
+// CNAME chains and several A records, all of them printed on one line.
+// Answers, negative ones too, are cached by name and type for their TTL,
+// so a repeated name costs neither a query nor a parse, and a name that
+// is already in flight waits for that query instead of sending its own.
+
+#define _GNU_SOURCE // sendmmsg, recvmmsg
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/random.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -44,10 +76,36 @@
 // The entire hostname, including the delimiting dots, has a maximum of 253 ASCII characters.
 static uint8_t hostname[MAX_SIZE];
 static uint8_t request[MAX_SIZE];
-static uint8_t ipv4[MAX_SIZE];
 #define BUFFER_SIZE MAX_SIZE
 static uint8_t buffer[BUFFER_SIZE];
 
+#define MAX_IN_FLIGHT 4096
+#define DEFAULT_IN_FLIGHT 256
+#define MAX_QUERY_SIZE 512 // a UDP DNS message without EDNS
+#define TICK_MS 10
+#define WHEEL_SIZE 1024 // ticks, longer than the longest timeout
+#define TIMEOUT_MS 500
+#define MAX_ATTEMPTS 4
+#define NO_QUERY -1
+#define NO_NAME SIZE_MAX
+#define NAME_SIZE 256 // a dotted name with the terminating zero
+#define MAX_NAME_LENGTH 253
+#define MAX_LABEL_LENGTH 63
+#define MAX_ADDRESSES 16
+#define MAX_RECORDS 64 // answers looked at
+#define MAX_CNAME_HOPS 8
+#define MAX_SERVERS 16
+#define BATCH_SIZE 64 // datagrams per sendmmsg or recvmmsg
+#define RECEIVE_BUFFER_SIZE (4 << 20)
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_TC 0x02
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
 struct dns_header {
     // Данное поле используется как уникальный идентификатор транзакции.
     // Указывает на то, что пакет принадлежит одной и той же
@@ -131,8 +189,8 @@ struct dns_footer {
 
 static struct dns_footer  dns_footer ;
 
-void initialize_dns_header() {
-    dns_header.ID = htons(0x9bce);
+void initialize_dns_header(uint16_t id) {
+    dns_header.ID = htons(id);
 //    dns_header.QR = 0; // значит этот пакет является запросом;
 //    dns_header.Opcode = 0b0000; // Стандартный запрос;
 //    dns_header.AA = 0; // данное поле имеет смысл только в DNS-ответах, поэтому всегда 0;
@@ -160,55 +218,853 @@ uint64_t combine_queries(uint64_t request_size) {
     return sizeof(dns_header) + request_size + sizeof(dns_footer);
 }
 
-void make_ipv4(int64_t received_size) {
-    for (uint64_t i = 0, begin = received_size - 4; i < 4; ++i) {
-        ipv4[i] = buffer[begin + i];
+void write_buffer(int64_t size) {
+    for (int i = 0; i < size; ++i) {
+        printf("%02X ", buffer[i]);
     }
-    ipv4[5] = '\0';
+    putc('\n', stdout);
 }
 
-void putc_ipv4() {
-    for (int i = 0; i < 4; ++i) {
-        printf("%d", ipv4[i]);
-        if (i != 3) {
-            putc('.', stdout);
+// A cache entry is empty, has a query in flight or holds an answer until
+// expires_ms. Names that asked for a pending entry are chained through
+// waiting_next, all of them get the answer of its one query.
+enum cache_state {
+    CACHE_EMPTY,
+    CACHE_PENDING,
+    CACHE_POSITIVE,
+    CACHE_NEGATIVE,
+};
+
+struct cache_entry {
+    char* name; // lowercase, without the trailing dot
+    uint16_t type;
+    enum cache_state state;
+    uint64_t expires_ms;
+    char* text; // the printed line, formatted once
+    const char* error; // why a negative answer has no addresses
+    size_t first_waiting;
+    struct cache_entry* next;
+};
+
+// What a response says about the name of its query.
+struct answer {
+    enum cache_state state; // CACHE_EMPTY if the response is unusable
+    uint32_t ttl; // seconds, 0 is not cached
+    const char* error;
+    int addresses_count;
+    uint32_t addresses[MAX_ADDRESSES]; // network order
+};
+
+// A resource record, its data is left in the packet.
+struct record {
+    char name[NAME_SIZE];
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t length;
+    size_t data; // offset
+};
+
+// A query in flight, it is in the wheel bucket of its deadline.
+struct query {
+    struct cache_entry* entry;
+    uint16_t id;
+    int attempts;
+    int first_server;
+    uint64_t started_us;
+    uint64_t deadline; // tick
+    int previous;
+    int next;
+    uint16_t size;
+    uint8_t packet[MAX_QUERY_SIZE];
+};
+
+// The result of a name, printed in input order.
+struct result {
+    bool done;
+    char* text;
+};
+
+static char** names;
+static size_t names_count;
+static struct result* results;
+// the next name waiting for the same pending cache entry or NO_NAME
+static size_t* waiting_next;
+
+static struct cache_entry** cache_buckets;
+static size_t cache_buckets_count;
+static size_t cache_size;
+
+static struct query queries[MAX_IN_FLIGHT];
+static int free_queries[MAX_IN_FLIGHT];
+static int free_queries_count;
+// transaction ID -> query or NO_QUERY
+static int query_by_id[UINT16_MAX + 1];
+static int wheel[WHEEL_SIZE];
+static uint64_t wheel_tick;
+
+static int socket_fd;
+static struct sockaddr_in servers[MAX_SERVERS];
+static int servers_count;
+static int next_server;
+static bool parallel;
+
+static struct mmsghdr send_batch[BATCH_SIZE];
+static struct iovec send_vectors[BATCH_SIZE];
+static int send_batch_count;
+static struct mmsghdr receive_batch[BATCH_SIZE];
+static struct iovec receive_vectors[BATCH_SIZE];
+static struct sockaddr_in receive_addresses[BATCH_SIZE];
+static uint8_t receive_buffers[BATCH_SIZE][MAX_SIZE];
+
+// for -S
+static bool print_stats;
+static uint64_t* latencies_us; // of every finished query
+static size_t queries_count;
+static size_t finished_count;
+static size_t datagrams_count;
+static size_t failures_count;
+
+static const char* const rcode_errors[] = {
+    "no error", "format error", "server failure", "name does not exist",
+    "not implemented", "refused",
+};
+
+uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+uint64_t now_tick() {
+    return now_ms() / TICK_MS;
+}
+
+void* allocate(size_t size) {
+    void* memory = calloc(1, size);
+    if (memory == NULL) {
+        perror("calloc");
+        exit(errno);
+    }
+    return memory;
+}
+
+void read_names() {
+    size_t capacity = 0;
+    // a name of any length is one name, one that is too long fails later
+    while (scanf("%4095s", hostname) > 0) { // MAX_SIZE - 1
+        if (strlen((const char*)hostname) == MAX_SIZE - 1) {
+            scanf("%*[^ \t\n\v\f\r]");
         }
+        if (names_count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            names = realloc(names, capacity * sizeof(char*));
+            if (names == NULL) {
+                perror("realloc");
+                exit(errno);
+            }
+        }
+        names[names_count++] = strdup((const char*)hostname);
     }
+    results = allocate((names_count + 1) * sizeof(struct result));
+    waiting_next = allocate((names_count + 1) * sizeof(size_t));
+    latencies_us = allocate((names_count + 1) * sizeof(uint64_t));
 }
 
-void write_buffer(int64_t size) {
-    for (int i = 0; i < size; ++i) {
-        printf("%02X ", buffer[i]);
+// The cache key of a name: lowercase, trailing dots dropped. Returns false
+// for a name a query cannot carry: longer than MAX_NAME_LENGTH or with a
+// label that is empty or longer than MAX_LABEL_LENGTH.
+bool normalize_name(const char* name, char* key) {
+    size_t length = strlen(name);
+    while (length > 0 && name[length - 1] == '.') {
+        --length;
     }
-    putc('\n', stdout);
+    if (length > MAX_NAME_LENGTH) {
+        return false;
+    }
+    size_t label_length = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (name[i] == '.') {
+            if (label_length == 0) {
+                return false;
+            }
+            label_length = 0;
+        } else if (++label_length > MAX_LABEL_LENGTH) {
+            return false;
+        }
+        key[i] = tolower((unsigned char)name[i]);
+    }
+    key[length] = '\0';
+    return true;
+}
+
+uint64_t hash_key(const char* name, uint16_t type) {
+    uint64_t hash = 14695981039346656037ULL ^ type; // FNV-1a
+    for (; *name != '\0'; ++name) {
+        hash = (hash ^ (uint8_t)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void cache_grow() {
+    const size_t buckets_count = cache_buckets_count == 0 ? 1024 : cache_buckets_count * 2;
+    struct cache_entry** buckets = allocate(buckets_count * sizeof(struct cache_entry*));
+    for (size_t i = 0; i < cache_buckets_count; ++i) {
+        struct cache_entry* entry = cache_buckets[i];
+        while (entry != NULL) {
+            struct cache_entry* next = entry->next;
+            struct cache_entry** bucket =
+                &buckets[hash_key(entry->name, entry->type) & (buckets_count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(cache_buckets);
+    cache_buckets = buckets;
+    cache_buckets_count = buckets_count;
+}
+
+// Finds the entry of the key or adds an empty one.
+struct cache_entry* cache_find(const char* name, uint16_t type) {
+    if (cache_size >= cache_buckets_count) {
+        cache_grow();
+    }
+    struct cache_entry** bucket = &cache_buckets[hash_key(name, type) & (cache_buckets_count - 1)];
+    for (struct cache_entry* entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->type == type && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    struct cache_entry* entry = allocate(sizeof(struct cache_entry));
+    entry->name = strdup(name);
+    entry->type = type;
+    entry->state = CACHE_EMPTY;
+    entry->first_waiting = NO_NAME;
+    entry->next = *bucket;
+    *bucket = entry;
+    ++cache_size;
+    return entry;
+}
+
+void cache_free() {
+    for (size_t i = 0; i < cache_buckets_count; ++i) {
+        struct cache_entry* entry = cache_buckets[i];
+        while (entry != NULL) {
+            struct cache_entry* next = entry->next;
+            free(entry->name);
+            free(entry->text);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache_buckets);
+}
+
+void finish_name(size_t name_index, const char* text, const char* error) {
+    if (error != NULL) {
+        fprintf(stderr, "%s: %s\n", names[name_index], error);
+    }
+    results[name_index].text = strdup(text);
+    results[name_index].done = true;
+}
+
+// Gives the answer to every name waiting for the entry and keeps it for
+// its TTL. A failure is not kept, the next name asks again.
+void resolve_entry(struct cache_entry* entry, const struct answer* answer) {
+    char text[MAX_ADDRESSES * INET_ADDRSTRLEN] = "";
+    for (int i = 0; i < answer->addresses_count; ++i) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &answer->addresses[i], address, sizeof(address));
+        if (i > 0) {
+            strcat(text, " ");
+        }
+        strcat(text, address);
+    }
+    for (size_t name_index = entry->first_waiting; name_index != NO_NAME;
+         name_index = waiting_next[name_index]) {
+        finish_name(name_index, text, answer->error);
+    }
+    entry->first_waiting = NO_NAME;
+    free(entry->text);
+    entry->text = NULL;
+    if (answer->state == CACHE_EMPTY || answer->ttl == 0) {
+        entry->state = CACHE_EMPTY;
+        return;
+    }
+    entry->state = answer->state;
+    entry->text = strdup(text);
+    entry->error = answer->error;
+    entry->expires_ms = now_ms() + answer->ttl * 1000ULL;
+}
+
+uint16_t read_uint16(const uint8_t* data) {
+    return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+uint32_t read_uint32(const uint8_t* data) {
+    return (uint32_t)read_uint16(data) << 16 | read_uint16(data + 2);
+}
+
+// Reads the possibly compressed name at *offset as lowercase dotted text
+// ("" for the root) and moves *offset past it. Every pointer has to go
+// back from the one before, so a packet cannot make a loop.
+bool read_name(const uint8_t* packet, size_t size, size_t* offset, char* name) {
+    size_t position = *offset;
+    size_t limit = position;
+    size_t length = 0;
+    bool jumped = false;
+    while (true) {
+        if (position >= size) {
+            return false;
+        }
+        const uint8_t label = packet[position];
+        if ((label & 0xC0) == 0xC0) {
+            if (position + 1 >= size) {
+                return false;
+            }
+            const size_t target = (size_t)(label & 0x3F) << 8 | packet[position + 1];
+            if (target >= limit) {
+                return false;
+            }
+            if (!jumped) {
+                *offset = position + 2;
+                jumped = true;
+            }
+            position = limit = target;
+            continue;
+        }
+        if (label & 0xC0) {
+            return false; // reserved label types
+        }
+        if (label == 0) {
+            if (!jumped) {
+                *offset = position + 1;
+            }
+            name[length] = '\0';
+            return true;
+        }
+        if (position + 1 + label > size || length + label + 1 >= NAME_SIZE) {
+            return false;
+        }
+        if (length > 0) {
+            name[length++] = '.';
+        }
+        for (int i = 1; i <= label; ++i) {
+            name[length++] = tolower(packet[position + i]);
+        }
+        position += 1 + label;
+    }
+}
+
+bool read_record(const uint8_t* packet, size_t size, size_t* offset, struct record* record) {
+    if (!read_name(packet, size, offset, record->name) || *offset + 10 > size) {
+        return false;
+    }
+    const uint8_t* fields = packet + *offset;
+    record->type = read_uint16(fields);
+    record->class = read_uint16(fields + 2);
+    record->ttl = read_uint32(fields + 4);
+    record->length = read_uint16(fields + 8);
+    record->data = *offset + 10;
+    if (record->data + record->length > size) {
+        return false;
+    }
+    if (record->ttl > INT32_MAX) {
+        record->ttl = 0; // RFC 2181: the top bit set means zero
+    }
+    *offset = record->data + record->length;
+    return true;
+}
+
+// The negative TTL of RFC 2308: the SOA of the authority section, its TTL
+// capped by its MINIMUM. Without an SOA the answer is not cached.
+uint32_t negative_ttl(const uint8_t* packet, size_t size, size_t offset, uint16_t authorities) {
+    struct record record;
+    for (uint16_t i = 0; i < authorities && read_record(packet, size, &offset, &record); ++i) {
+        if (record.type != DNS_TYPE_SOA || record.class != DNS_CLASS_IN) {
+            continue;
+        }
+        const size_t end = record.data + record.length;
+        size_t data = record.data;
+        char name[NAME_SIZE];
+        if (read_name(packet, end, &data, name) && read_name(packet, end, &data, name) &&
+            data + 20 <= end) {
+            const uint32_t minimum = read_uint32(packet + data + 16);
+            return record.ttl < minimum ? record.ttl : minimum;
+        }
+    }
+    return 0;
+}
+
+// Bounds-checked parse of a response to an A query for name. The A records
+// are taken from the end of the CNAME chain that starts at name, the TTL
+// is the smallest one along the chain. A truncated response is used only
+// for the records that fit and is not cached.
+void parse_response(const uint8_t* packet, size_t size, const char* name, struct answer* answer) {
+    static struct record records[MAX_RECORDS];
+    memset(answer, 0, sizeof(*answer));
+    answer->state = CACHE_EMPTY;
+
+    struct dns_header header;
+    memcpy(&header, packet, sizeof(header));
+    const bool truncated = header.QR_Opcode_AA_TC_RD & DNS_FLAG_TC;
+    const int rcode = header.RA_Z_RCODE & 0x0F;
+    if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+        answer->error = rcode < (int)(sizeof(rcode_errors) / sizeof(*rcode_errors))
+            ? rcode_errors[rcode]
+            : "error response";
+        return;
+    }
+
+    size_t offset = sizeof(header);
+    char owner[NAME_SIZE];
+    for (uint16_t i = 0; i < ntohs(header.QDCOUNT); ++i) {
+        if (!read_name(packet, size, &offset, owner) ||
+            offset + sizeof(struct dns_footer) > size) {
+            answer->error = "malformed response";
+            return;
+        }
+        offset += sizeof(struct dns_footer);
+    }
+    int records_count = 0;
+    bool complete = true;
+    for (uint16_t i = 0; i < ntohs(header.ANCOUNT); ++i) {
+        struct record record;
+        if (!read_record(packet, size, &offset, &record)) {
+            if (!truncated) {
+                answer->error = "malformed response";
+                return;
+            }
+            complete = false;
+            break;
+        }
+        if (records_count < MAX_RECORDS) {
+            records[records_count++] = record;
+        }
+    }
+
+    char current[NAME_SIZE];
+    char target[NAME_SIZE];
+    strcpy(current, name);
+    uint32_t ttl = UINT32_MAX;
+    for (int hops = 0;; ++hops) {
+        bool aliased = false;
+        for (int i = 0; i < records_count; ++i) {
+            const struct record* record = &records[i];
+            if (record->class != DNS_CLASS_IN || strcmp(record->name, current) != 0) {
+                continue;
+            }
+            if (record->type == DNS_TYPE_A && record->length == 4) {
+                uint32_t address;
+                memcpy(&address, packet + record->data, sizeof(address));
+                int j = 0;
+                while (j < answer->addresses_count && answer->addresses[j] != address) {
+                    ++j;
+                }
+                if (j == answer->addresses_count && j < MAX_ADDRESSES) {
+                    answer->addresses[answer->addresses_count++] = address;
+                }
+                ttl = record->ttl < ttl ? record->ttl : ttl;
+            } else if (record->type == DNS_TYPE_CNAME && !aliased) {
+                size_t data = record->data;
+                if (read_name(packet, record->data + record->length, &data, target)) {
+                    aliased = true;
+                    ttl = record->ttl < ttl ? record->ttl : ttl;
+                }
+            }
+        }
+        if (answer->addresses_count > 0 || !aliased) {
+            break;
+        }
+        if (hops == MAX_CNAME_HOPS) {
+            answer->error = "too many aliases";
+            return;
+        }
+        strcpy(current, target);
+    }
+
+    if (answer->addresses_count > 0) {
+        answer->state = CACHE_POSITIVE;
+        answer->ttl = truncated ? 0 : ttl;
+    } else if (truncated) {
+        answer->error = "truncated response";
+    } else {
+        answer->state = CACHE_NEGATIVE;
+        answer->error = rcode == DNS_RCODE_NXDOMAIN ? rcode_errors[rcode] : "no address";
+        answer->ttl = complete ? negative_ttl(packet, size, offset, ntohs(header.NSCOUNT)) : 0;
+    }
+}
+
+void wheel_insert(int index, uint64_t deadline) {
+    struct query* query = &queries[index];
+    int* bucket = &wheel[deadline % WHEEL_SIZE];
+    query->deadline = deadline;
+    query->previous = NO_QUERY;
+    query->next = *bucket;
+    if (*bucket != NO_QUERY) {
+        queries[*bucket].previous = index;
+    }
+    *bucket = index;
+}
+
+void wheel_remove(int index) {
+    struct query* query = &queries[index];
+    if (query->previous != NO_QUERY) {
+        queries[query->previous].next = query->next;
+    } else {
+        wheel[query->deadline % WHEEL_SIZE] = query->next;
+    }
+    if (query->next != NO_QUERY) {
+        queries[query->next].previous = query->previous;
+    }
+}
+
+// A lost datagram is retransmitted by the timer, so errors are not fatal:
+// what the socket cannot take now is dropped.
+void flush_sends() {
+    for (int sent = 0; sent < send_batch_count;) {
+        const int result = sendmmsg(socket_fd, send_batch + sent, send_batch_count - sent, 0);
+        if (result != -1) {
+            sent += result;
+        } else if (errno == EAGAIN || errno == ENOBUFS) {
+            break;
+        } else if (errno != EINTR) {
+            perror("sendmmsg");
+            ++sent;
+        }
+    }
+    send_batch_count = 0;
+}
+
+// The packet of the query must stay until the batch is flushed.
+void queue_datagram(const struct query* query, struct sockaddr_in* server) {
+    if (send_batch_count == BATCH_SIZE) {
+        flush_sends();
+    }
+    struct iovec* vector = &send_vectors[send_batch_count];
+    vector->iov_base = (void*)query->packet;
+    vector->iov_len = query->size;
+    send_batch[send_batch_count++].msg_hdr = (struct msghdr){
+        .msg_name = server,
+        .msg_namelen = sizeof(*server),
+        .msg_iov = vector,
+        .msg_iovlen = 1,
+    };
+    ++datagrams_count;
+}
+
+void send_query(int index) {
+    struct query* query = &queries[index];
+    ++query->attempts;
+    if (parallel) {
+        for (int i = 0; i < servers_count; ++i) {
+            queue_datagram(query, &servers[i]);
+        }
+    } else {
+        queue_datagram(query, &servers[(query->first_server + query->attempts - 1) % servers_count]);
+    }
+    const uint64_t timeout_ms = (uint64_t)TIMEOUT_MS << (query->attempts - 1);
+    wheel_insert(index, now_tick() + timeout_ms / TICK_MS);
+}
+
+void start_query(struct cache_entry* entry) {
+    const int index = free_queries[--free_queries_count];
+    struct query* query = &queries[index];
+    // a random ID no query in flight has
+    uint16_t id;
+    do {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+            id = random();
+        }
+    } while (query_by_id[id] != NO_QUERY);
+    query_by_id[id] = index;
+
+    strcpy((char*)hostname, entry->name);
+    initialize_dns_header(id);
+    uint64_t request_size = make_request();
+    initialize_dns_footer();
+    query->size = combine_queries(request_size);
+    memcpy(query->packet, buffer, query->size);
+    query->entry = entry;
+    query->id = id;
+    query->attempts = 0;
+    query->first_server = next_server;
+    next_server = (next_server + 1) % servers_count;
+    query->started_us = now_us();
+    ++queries_count;
+    send_query(index);
+}
+
+// The query must be out of the wheel.
+void finish_query(int index, const struct answer* answer) {
+    struct query* query = &queries[index];
+    query_by_id[query->id] = NO_QUERY;
+    free_queries[free_queries_count++] = index;
+    latencies_us[finished_count++] = now_us() - query->started_us;
+    failures_count += answer->state == CACHE_EMPTY;
+    resolve_entry(query->entry, answer);
+}
+
+// Takes a response if it answers a query in flight: the same ID, QR set
+// and the same question, names compared case-insensitively.
+void handle_response(const uint8_t* packet, int64_t received_size) {
+    if (received_size < (int64_t)sizeof(struct dns_header)) {
+        return;
+    }
+    struct dns_header header;
+    memcpy(&header, packet, sizeof(header));
+    const int index = query_by_id[ntohs(header.ID)];
+    if (index == NO_QUERY || !(header.QR_Opcode_AA_TC_RD & 0x80)) {
+        return;
+    }
+    struct query* query = &queries[index];
+    const size_t question_size = query->size - sizeof(struct dns_header);
+    if ((size_t)received_size < query->size ||
+        strncasecmp((const char*)packet + sizeof(struct dns_header),
+                    (const char*)query->packet + sizeof(struct dns_header),
+                    question_size - sizeof(struct dns_footer)) != 0 ||
+        memcmp(packet + query->size - sizeof(struct dns_footer),
+               query->packet + query->size - sizeof(struct dns_footer),
+               sizeof(struct dns_footer)) != 0) {
+        return;
+    }
+    struct answer answer;
+    parse_response(packet, received_size, query->entry->name, &answer);
+    wheel_remove(index);
+    finish_query(index, &answer);
+}
+
+bool is_server(const struct sockaddr_in* address) {
+    for (int i = 0; i < servers_count; ++i) {
+        if (servers[i].sin_addr.s_addr == address->sin_addr.s_addr &&
+            servers[i].sin_port == address->sin_port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes everything the socket has, a batch per syscall.
+void receive_responses() {
+    while (true) {
+        for (int i = 0; i < BATCH_SIZE; ++i) {
+            receive_vectors[i].iov_base = receive_buffers[i];
+            receive_vectors[i].iov_len = MAX_SIZE;
+            receive_batch[i].msg_hdr = (struct msghdr){
+                .msg_name = &receive_addresses[i],
+                .msg_namelen = sizeof(receive_addresses[i]),
+                .msg_iov = &receive_vectors[i],
+                .msg_iovlen = 1,
+            };
+        }
+        const int received = recvmmsg(socket_fd, receive_batch, BATCH_SIZE, 0, NULL);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            CHECK_ON_ERROR(received, "recvmmsg");
+        }
+        for (int i = 0; i < received; ++i) {
+            if (is_server(&receive_addresses[i])) {
+                handle_response(receive_buffers[i], receive_batch[i].msg_len);
+            }
+        }
+        if (received < BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+// Retransmits or gives up the queries whose deadline is the tick.
+void expire_tick(uint64_t tick) {
+    int index = wheel[tick % WHEEL_SIZE];
+    while (index != NO_QUERY) {
+        const int next = queries[index].next;
+        if (queries[index].deadline == tick) {
+            wheel_remove(index);
+            if (queries[index].attempts < MAX_ATTEMPTS) {
+                send_query(index);
+            } else {
+                const struct answer answer = {.state = CACHE_EMPTY, .error = "no response"};
+                finish_query(index, &answer);
+            }
+        }
+        index = next;
+    }
+}
+
+// Answers the name from the cache, joins the query in flight for it or
+// starts one. Returns false if a query is needed and none is free.
+bool lookup_name(size_t name_index, uint64_t now) {
+    char key[NAME_SIZE];
+    if (!normalize_name(names[name_index], key)) {
+        finish_name(name_index, "", "bad name");
+        return true;
+    }
+    struct cache_entry* entry = cache_find(key, DNS_TYPE_A);
+    if ((entry->state == CACHE_POSITIVE || entry->state == CACHE_NEGATIVE) &&
+        entry->expires_ms > now) {
+        finish_name(name_index, entry->text, entry->error);
+        return true;
+    }
+    if (entry->state == CACHE_PENDING) {
+        waiting_next[name_index] = entry->first_waiting;
+        entry->first_waiting = name_index;
+        return true;
+    }
+    if (free_queries_count == 0) {
+        return false;
+    }
+    entry->state = CACHE_PENDING;
+    waiting_next[name_index] = NO_NAME;
+    entry->first_waiting = name_index;
+    start_query(entry);
+    return true;
+}
+
+void parse_server(const char* value, struct sockaddr_in* addr_in) {
+    char host[INET_ADDRSTRLEN];
+    const char* colon = strchr(value, ':');
+    const size_t host_length = colon == NULL ? strlen(value) : (size_t)(colon - value);
+    if (host_length >= sizeof(host)) {
+        fprintf(stderr, "bad server %s\n", value);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(host, value, host_length);
+    host[host_length] = '\0';
+    if (inet_pton(AF_INET, host, &addr_in->sin_addr) != 1) {
+        fprintf(stderr, "bad server %s\n", value);
+        exit(EXIT_FAILURE);
+    }
+    if (colon != NULL) {
+        addr_in->sin_port = htons(atoi(colon + 1));
+    }
+}
+
+// ADDRESS[:PORT] separated by commas.
+void parse_servers(char* value) {
+    for (char* server = strtok(value, ","); server != NULL; server = strtok(NULL, ",")) {
+        if (servers_count == MAX_SERVERS) {
+            fprintf(stderr, "more than %d servers\n", MAX_SERVERS);
+            exit(EXIT_FAILURE);
+        }
+        servers[servers_count] = (struct sockaddr_in){
+            .sin_family = AF_INET,
+            .sin_port = htons(53), // UDP
+        };
+        parse_server(server, &servers[servers_count++]);
+    }
+}
+
+int compare_latencies(const void* lhs, const void* rhs) {
+    const uint64_t left = *(const uint64_t*)lhs;
+    const uint64_t right = *(const uint64_t*)rhs;
+    return (left > right) - (left < right);
+}
+
+double percentile_ms(double fraction) {
+    size_t index = fraction * finished_count;
+    if (index >= finished_count) {
+        index = finished_count - 1;
+    }
+    return latencies_us[index] / 1000.0;
+}
+
+void print_statistics(uint64_t elapsed_us) {
+    const double seconds = elapsed_us / 1e6;
+    fprintf(stderr,
+            "%zu names, %zu queries, %zu datagrams, %zu failed in %.3f s: "
+            "%.0f names/s, %.0f queries/s\n",
+            names_count, queries_count, datagrams_count, failures_count, seconds,
+            names_count / seconds, queries_count / seconds);
+    if (finished_count == 0) {
+        return;
+    }
+    qsort(latencies_us, finished_count, sizeof(uint64_t), compare_latencies);
+    fprintf(stderr, "query latency ms: p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+            percentile_ms(0.5), percentile_ms(0.9), percentile_ms(0.99), percentile_ms(0.999),
+            latencies_us[finished_count - 1] / 1000.0);
 }
 
 // char и little endian это злоо
 int main(int argc, char** argv) {
-    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int option;
+    while ((option = getopt(argc, argv, "pS")) != -1) {
+        switch (option) {
+        case 'p':
+            parallel = true;
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p] [-S] [SERVER[,SERVER]... [IN_FLIGHT]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    char default_server[] = /* INADDR_LOOPBACK */ "8.8.8.8";
+    parse_servers(optind < argc ? argv[optind] : default_server);
+    int max_in_flight = optind + 1 < argc ? atoi(argv[optind + 1]) : DEFAULT_IN_FLIGHT;
+    if (max_in_flight < 1 || max_in_flight > MAX_IN_FLIGHT) {
+        max_in_flight = DEFAULT_IN_FLIGHT;
+    }
+
+    // not connected, there can be several servers
+    socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     CHECK_ON_ERROR(socket_fd, "socket");
-    const struct sockaddr_in addr_in = {
-        .sin_family = AF_INET,
-        .sin_port = htons(53), // UDP
-        .sin_addr.s_addr = /* INADDR_LOOPBACK */ inet_addr("8.8.8.8")
-    };
-    while (scanf("%s", hostname) > 0) {
-        initialize_dns_header();
-        uint64_t request_size = make_request();
-        initialize_dns_footer();
-
-        uint64_t total_size = combine_queries(request_size);
-
-//        write_buffer(total_size);
-        CHECK_ON_ERROR(sendto(socket_fd, buffer, total_size, 0,
-                              (const struct sockaddr*)&addr_in, sizeof(addr_in)), "sendto");
-        int64_t received_size = recv(socket_fd, buffer, BUFFER_SIZE, 0);
-        CHECK_ON_ERROR(received_size, "recv");
-//        write_buffer(received_size);
-        make_ipv4(received_size);
-        putc_ipv4();
-        putc('\n', stdout);
+    // a burst of responses should not overflow the socket, a smaller buffer is fine too
+    const int receive_buffer_size = RECEIVE_BUFFER_SIZE;
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size));
+
+    read_names();
+    for (int i = 0; i <= UINT16_MAX; ++i) {
+        query_by_id[i] = NO_QUERY;
     }
+    for (int i = 0; i < WHEEL_SIZE; ++i) {
+        wheel[i] = NO_QUERY;
+    }
+    for (int i = 0; i < max_in_flight; ++i) {
+        free_queries[free_queries_count++] = max_in_flight - 1 - i;
+    }
+    const uint64_t started_us = now_us();
+    wheel_tick = now_tick();
+
+    size_t next_name = 0;
+    size_t printed = 0;
+    while (printed < names_count) {
+        for (const uint64_t now = now_ms(); next_name < names_count && lookup_name(next_name, now);) {
+            ++next_name;
+        }
+        flush_sends();
+
+        struct pollfd poll_fd = {.fd = socket_fd, .events = POLLIN};
+        CHECK_ON_ERROR(poll(&poll_fd, 1, TICK_MS), "poll");
+        receive_responses();
+
+        for (const uint64_t tick = now_tick(); wheel_tick < tick;) {
+            expire_tick(++wheel_tick);
+        }
+        flush_sends();
+
+        for (; printed < names_count && results[printed].done; ++printed) {
+            puts(results[printed].text);
+            free(results[printed].text);
+            free(names[printed]);
+        }
+    }
+    if (print_stats) {
+        print_statistics(now_us() - started_us);
+    }
+    free(names);
+    free(results);
+    free(waiting_next);
+    free(latencies_us);
+    cache_free();
     close(socket_fd);
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
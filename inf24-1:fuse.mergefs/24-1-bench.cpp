@@ -0,0 +1,557 @@
+// Benchmark for the 24-1 mergefs.
+//
+// g++ -std=c++17 -O2 24-1-bench.cpp -lpthread -o bench
+// ./bench --mergefs ./myfs --files 10000 --branches 3 --overlap 0.25
+// ./bench --mergefs ./myfs --depth 3 --width 8 --wide 50000 --threads 4 --directory /tmp/tree
+//
+// Generates synthetic branches, mounts mergefs on them and runs the same
+// operations on the mount and on the raw directories:
+//   - every file lives in branch (i % branches); a share of --overlap of them
+//     is also put into every other branch with an older mtime, so the merge
+//     has to pick the newest candidate;
+//   - files are spread over --depth levels of --width subdirectories, plus
+//     --wide files in the single directory "wide" for large listings;
+//   - sizes are picked by weight from --sizes, as in 16-1-load.
+//
+// The raw side stats and reads each file in its winning branch and lists
+// every virtual directory in every branch, which is what a union costs
+// without mergefs. The trees are generated (or reused, see --directory)
+// before anything is timed, so both sides run with a warm page cache. The
+// mount keeps entries for 60 s, hence the two stat passes: the first one
+// goes to mergefs, the second is served by the kernel cache.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <signal.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace task {
+
+namespace {
+
+constexpr size_t kReadSize = 128 * 1024;
+constexpr size_t kRandomReadSize = 4096;
+constexpr auto kMountTimeout = std::chrono::seconds(120);
+
+struct SizeWeight {
+    off_t size;
+    int weight;
+};
+
+struct Options {
+    size_t files = 10000;
+    size_t depth = 2;
+    size_t width = 16;
+    size_t wide = 10000;
+    size_t branches = 3;
+    double overlap = 0.25;
+    std::vector<SizeWeight> sizes;
+    size_t reads = 10000;
+    size_t threads = 1;
+    std::string mergefs;
+    std::string directory;
+    bool keep = false;
+};
+
+// One generated file: its path inside a branch and the branch of the winner.
+struct File {
+    std::string path;
+    size_t branch;
+    off_t size;
+};
+
+Options options;
+std::vector<File> files;
+// virtual directories, "" is the root
+std::vector<std::string> directories;
+
+double Seconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+void Fail(const std::string& what) {
+    std::cerr << what << ": " << strerror(errno) << "\n";
+    exit(1);
+}
+
+off_t ParseSize(const char* value, char** end) {
+    off_t size = strtoll(value, end, 10);
+    switch (**end) {
+    case 'k':
+    case 'K':
+        size <<= 10;
+        ++*end;
+        break;
+    case 'm':
+    case 'M':
+        size <<= 20;
+        ++*end;
+        break;
+    case 'g':
+    case 'G':
+        size <<= 30;
+        ++*end;
+        break;
+    }
+    return size;
+}
+
+// "4k:95,64k:4,1m:1"
+void ParseSizes(const char* value) {
+    const auto bad = [] {
+        std::cerr << "bad --sizes, expected SIZE:WEIGHT[,SIZE:WEIGHT...] with positive weights\n";
+        exit(1);
+    };
+    options.sizes.clear();
+    while (*value != '\0') {
+        const char* begin = value;
+        char* end;
+        const off_t size = ParseSize(value, &end);
+        if (!isdigit(static_cast<unsigned char>(*begin)) || size < 0 || *end != ':') {
+            bad();
+        }
+        const char* weight_begin = end + 1;
+        const long weight = strtol(weight_begin, &end, 10);
+        if (end == weight_begin || weight <= 0 || weight > INT_MAX ||
+            (*end != ',' && *end != '\0')) {
+            bad();
+        }
+        options.sizes.push_back({size, static_cast<int>(weight)});
+        value = *end == ',' ? end + 1 : end;
+    }
+    if (options.sizes.empty()) {
+        bad();
+    }
+}
+
+std::string BranchPath(size_t branch) {
+    return options.directory + "/branch-" + std::to_string(branch);
+}
+
+std::string MountPath() {
+    return options.directory + "/mnt";
+}
+
+// Lays out the tree in memory: the same options give the same tree, so an
+// existing one can be reused.
+void PlanTree() {
+    std::mt19937_64 random(42);
+    int64_t total_weight = 0;
+    for (const auto& entry : options.sizes) {
+        total_weight += entry.weight;
+    }
+    const auto pick_size = [&] {
+        int64_t weight = random() % total_weight;
+        for (const auto& entry : options.sizes) {
+            if ((weight -= entry.weight) < 0) {
+                return entry.size;
+            }
+        }
+        return options.sizes.back().size;
+    };
+
+    files.clear();
+    directories.clear();
+    directories.push_back("");
+    std::vector<std::string> leaf_paths(1, "");
+    for (size_t level = 0; level < options.depth; ++level) {
+        std::vector<std::string> next;
+        for (const auto& parent : leaf_paths) {
+            for (size_t i = 0; i < options.width; ++i) {
+                next.push_back(parent + "/d" + std::to_string(i));
+                directories.push_back(next.back());
+            }
+        }
+        leaf_paths = std::move(next);
+    }
+    for (size_t i = 0; i < options.files; ++i) {
+        files.push_back(
+            {leaf_paths[i % leaf_paths.size()] + "/f" + std::to_string(i),
+             i % options.branches,
+             pick_size()});
+    }
+    if (options.wide != 0) {
+        directories.push_back("/wide");
+        for (size_t i = 0; i < options.wide; ++i) {
+            files.push_back({"/wide/w" + std::to_string(i), i % options.branches, pick_size()});
+        }
+    }
+}
+
+bool IsOverlapping(size_t file) {
+    // the same share in every directory
+    return (file * 2654435761u % 1000) < options.overlap * 1000;
+}
+
+void WriteFile(const std::string& path, off_t size, time_t mtime) {
+    static const std::string fill(64 * 1024, 'm');
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        Fail(path);
+    }
+    for (off_t written = 0; written < size;) {
+        const ssize_t bytes = write(fd, fill.data(), std::min<off_t>(fill.size(), size - written));
+        if (bytes == -1) {
+            Fail(path);
+        }
+        written += bytes;
+    }
+    const struct timespec times[] = {{mtime, 0}, {mtime, 0}};
+    futimens(fd, times);
+    close(fd);
+}
+
+void GenerateTree() {
+    const time_t now = time(nullptr);
+    for (size_t branch = 0; branch < options.branches; ++branch) {
+        for (const auto& directory : directories) {
+            const auto& path = BranchPath(branch) + directory;
+            if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+                Fail(path);
+            }
+        }
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& file = files[i];
+        WriteFile(BranchPath(file.branch) + file.path, file.size, now);
+        if (IsOverlapping(i)) {
+            for (size_t branch = 0; branch < options.branches; ++branch) {
+                if (branch != file.branch) {
+                    // older, so the merge must not pick it
+                    WriteFile(BranchPath(branch) + file.path, file.size / 2, now - 3600);
+                }
+            }
+        }
+    }
+}
+
+pid_t Mount(double* startup) {
+    std::string sources;
+    for (size_t branch = 0; branch < options.branches; ++branch) {
+        sources += (branch == 0 ? "" : ":") + BranchPath(branch);
+    }
+    mkdir(MountPath().c_str(), 0755);
+    struct stat before {};
+    if (stat(MountPath().c_str(), &before) == -1) {
+        Fail(MountPath());
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl(
+            options.mergefs.c_str(), options.mergefs.c_str(), MountPath().c_str(), "-f",
+            "--src", sources.c_str(), "--scan-stats", nullptr);
+        Fail(options.mergefs);
+    }
+    // mounted once the mount point is on another device
+    while (true) {
+        struct stat now {};
+        if (stat(MountPath().c_str(), &now) == 0 && now.st_dev != before.st_dev) {
+            break;
+        }
+        if (waitpid(pid, nullptr, WNOHANG) == pid ||
+            std::chrono::steady_clock::now() - start > kMountTimeout) {
+            std::cerr << "mergefs did not mount\n";
+            kill(pid, SIGTERM);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    *startup = Seconds(std::chrono::steady_clock::now() - start);
+    return pid;
+}
+
+void Unmount(pid_t pid) {
+    const pid_t fusermount = fork();
+    if (fusermount == 0) {
+        execlp("fusermount3", "fusermount3", "-u", MountPath().c_str(), nullptr);
+        Fail("fusermount3");
+    }
+    waitpid(fusermount, nullptr, 0);
+    waitpid(pid, nullptr, 0);
+}
+
+// Runs work(thread, first, last) over [0, count) split between the threads
+// and returns the elapsed seconds.
+double Parallel(size_t count, const std::function<void(size_t, size_t)>& work) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t thread = 0; thread < options.threads; ++thread) {
+        threads.emplace_back(work, count * thread / options.threads, count * (thread + 1) / options.threads);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return Seconds(std::chrono::steady_clock::now() - start);
+}
+
+// root(file) is the directory a file is looked up in: its winning branch
+// or the mount point.
+using Root = std::function<std::string(const File&)>;
+
+double StatFiles(const std::vector<size_t>& order, const Root& root) {
+    std::atomic<size_t> failed = 0;
+    const double seconds = Parallel(order.size(), [&](size_t first, size_t last) {
+        struct stat st;
+        for (size_t i = first; i < last; ++i) {
+            const auto& file = files[order[i]];
+            if (stat((root(file) + file.path).c_str(), &st) == -1 || st.st_size != file.size) {
+                ++failed;
+            }
+        }
+    });
+    if (failed != 0) {
+        std::cerr << failed << " files failed or had the wrong size\n";
+    }
+    return order.size() / seconds;
+}
+
+// Lists every directory under each of roots, with a stat per name if
+// with_stat; returns names per second.
+double ListDirectories(const std::vector<std::string>& roots, bool with_stat) {
+    size_t names = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& directory : directories) {
+        for (const auto& root : roots) {
+            DIR* stream = opendir((root + directory).c_str());
+            if (stream == nullptr) {
+                Fail(root + directory);
+            }
+            struct stat st;
+            while (const struct dirent* item = readdir(stream)) {
+                ++names;
+                if (with_stat) {
+                    fstatat(dirfd(stream), item->d_name, &st, 0);
+                }
+            }
+            closedir(stream);
+        }
+    }
+    return names / Seconds(std::chrono::steady_clock::now() - start);
+}
+
+// Reads every file from start to end; returns MiB per second.
+double ReadSequentially(const Root& root) {
+    std::atomic<off_t> total = 0;
+    const double seconds = Parallel(files.size(), [&](size_t first, size_t last) {
+        std::vector<char> buffer(kReadSize);
+        for (size_t i = first; i < last; ++i) {
+            const int fd = open((root(files[i]) + files[i].path).c_str(), O_RDONLY);
+            if (fd == -1) {
+                Fail(files[i].path);
+            }
+            ssize_t bytes;
+            while ((bytes = read(fd, buffer.data(), buffer.size())) > 0) {
+                total += bytes;
+            }
+            close(fd);
+        }
+    });
+    return total / seconds / (1 << 20);
+}
+
+// open + pread of kRandomReadSize at a random offset + close; returns
+// operations per second.
+double ReadRandomly(const Root& root) {
+    const double seconds = Parallel(options.reads, [&](size_t first, size_t last) {
+        std::mt19937_64 random(first);
+        char buffer[kRandomReadSize];
+        for (size_t i = first; i < last; ++i) {
+            const auto& file = files[random() % files.size()];
+            const int fd = open((root(file) + file.path).c_str(), O_RDONLY);
+            if (fd == -1) {
+                Fail(file.path);
+            }
+            pread(fd, buffer, sizeof(buffer), random() % (file.size + 1));
+            close(fd);
+        }
+    });
+    return options.reads / seconds;
+}
+
+void PrintRow(const std::string& operation, double raw, double merged, const std::string& unit) {
+    std::cout << std::left << std::setw(24) << operation << std::right << std::fixed
+              << std::setprecision(1) << std::setw(14) << raw << std::setw(14) << merged
+              << "  " << std::setw(8) << unit << std::setprecision(2) << std::setw(10)
+              << merged / raw << "\n";
+}
+
+void Usage(const char* program) {
+    std::cerr
+        << "usage: " << program << " [options]\n"
+        << "  -m, --mergefs PATH     mergefs binary (default: 24-1 next to this one)\n"
+        << "  -D, --directory DIR    where the branches are generated, an existing\n"
+        << "                         tree made with the same options is reused\n"
+        << "  -n, --files N          files in the nested directories (10000)\n"
+        << "  -d, --depth N          levels of nested directories (2)\n"
+        << "  -w, --width N          subdirectories per directory (16)\n"
+        << "  -W, --wide N           files in the single large directory (10000)\n"
+        << "  -b, --branches N       branches (3)\n"
+        << "  -o, --overlap R        share of files present in every branch (0.25)\n"
+        << "  -s, --sizes MIX        file sizes by weight (4k:95,64k:4,1m:1)\n"
+        << "  -r, --reads N          random reads (10000)\n"
+        << "  -t, --threads N        threads for stats and reads (1)\n"
+        << "  -k, --keep             keep a generated tree\n";
+    exit(1);
+}
+
+} // namespace
+
+} // namespace task
+
+int main(int argc, char* argv[]) {
+    using namespace task;
+
+    const struct option long_options[] = {
+        {"mergefs", required_argument, nullptr, 'm'},
+        {"directory", required_argument, nullptr, 'D'},
+        {"files", required_argument, nullptr, 'n'},
+        {"depth", required_argument, nullptr, 'd'},
+        {"width", required_argument, nullptr, 'w'},
+        {"wide", required_argument, nullptr, 'W'},
+        {"branches", required_argument, nullptr, 'b'},
+        {"overlap", required_argument, nullptr, 'o'},
+        {"sizes", required_argument, nullptr, 's'},
+        {"reads", required_argument, nullptr, 'r'},
+        {"threads", required_argument, nullptr, 't'},
+        {"keep", no_argument, nullptr, 'k'},
+        {nullptr, 0, nullptr, 0}};
+
+    ParseSizes("4k:95,64k:4,1m:1");
+    const std::string program = argv[0];
+    options.mergefs = program.substr(0, program.rfind('/') + 1) + "24-1";
+    int option;
+    while ((option = getopt_long(argc, argv, "m:D:n:d:w:W:b:o:s:r:t:k", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'm':
+            options.mergefs = optarg;
+            break;
+        case 'D':
+            options.directory = optarg;
+            break;
+        case 'n':
+            options.files = strtoul(optarg, nullptr, 10);
+            break;
+        case 'd':
+            options.depth = strtoul(optarg, nullptr, 10);
+            break;
+        case 'w':
+            options.width = strtoul(optarg, nullptr, 10);
+            break;
+        case 'W':
+            options.wide = strtoul(optarg, nullptr, 10);
+            break;
+        case 'b':
+            options.branches = strtoul(optarg, nullptr, 10);
+            break;
+        case 'o':
+            options.overlap = strtod(optarg, nullptr);
+            break;
+        case 's':
+            ParseSizes(optarg);
+            break;
+        case 'r':
+            options.reads = strtoul(optarg, nullptr, 10);
+            break;
+        case 't':
+            options.threads = strtoul(optarg, nullptr, 10);
+            break;
+        case 'k':
+            options.keep = true;
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+    if (options.files + options.wide == 0 || options.branches == 0 || options.width == 0 ||
+        options.threads == 0 || options.sizes.empty()) {
+        Usage(argv[0]);
+    }
+
+    // a fresh tree is removed at the end unless --keep
+    bool generated = false;
+    if (options.directory.empty()) {
+        char directory[] = "/tmp/mergefs-bench-XXXXXX";
+        if (mkdtemp(directory) == nullptr) {
+            Fail("mkdtemp");
+        }
+        options.directory = directory;
+    }
+    PlanTree();
+    struct stat st;
+    if (stat(BranchPath(0).c_str(), &st) == 0) {
+        std::cout << "reusing the tree in " << options.directory << "\n";
+    } else {
+        mkdir(options.directory.c_str(), 0755);
+        const auto start = std::chrono::steady_clock::now();
+        GenerateTree();
+        generated = true;
+        std::cout << "generated " << files.size() << " files in " << directories.size()
+                  << " directories of " << options.branches << " branches in "
+                  << options.directory << " in " << std::fixed << std::setprecision(1)
+                  << Seconds(std::chrono::steady_clock::now() - start) << " s\n";
+    }
+
+    std::vector<std::string> raw_roots;
+    for (size_t branch = 0; branch < options.branches; ++branch) {
+        raw_roots.push_back(BranchPath(branch));
+    }
+    const Root raw = [](const File& file) { return BranchPath(file.branch); };
+    const Root merged = [](const File&) { return MountPath(); };
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(7));
+
+    double startup;
+    const pid_t pid = Mount(&startup);
+    std::cout << "mounted in " << std::fixed << std::setprecision(3) << startup << " s\n\n";
+
+    std::cout << std::left << std::setw(24) << "operation" << std::right << std::setw(14)
+              << "raw" << std::setw(14) << "mergefs" << "  " << std::setw(8) << "unit"
+              << std::setw(10) << "ratio" << "\n";
+    const double raw_stat = StatFiles(order, raw);
+    PrintRow("stat, first pass", raw_stat, StatFiles(order, merged), "op/s");
+    PrintRow("stat, kernel cache", raw_stat, StatFiles(order, merged), "op/s");
+    PrintRow(
+        "readdir, all",
+        ListDirectories(raw_roots, false),
+        ListDirectories({MountPath()}, false),
+        "names/s");
+    PrintRow(
+        "readdir + stat, all",
+        ListDirectories(raw_roots, true),
+        ListDirectories({MountPath()}, true),
+        "names/s");
+    PrintRow("sequential read", ReadSequentially(raw), ReadSequentially(merged), "MiB/s");
+    PrintRow("random 4k read", ReadRandomly(raw), ReadRandomly(merged), "op/s");
+
+    Unmount(pid);
+    if (generated && !options.keep) {
+        std::error_code error;
+        std::filesystem::remove_all(options.directory, error);
+    }
+    return 0;
+}
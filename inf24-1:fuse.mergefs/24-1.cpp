@@ -13,6 +13,9 @@
 // pkg-config fuse3 --cflags --libs
 // g++ -std=c++17 -Wall 24-1.cpp `pkg-config fuse3 --cflags --libs` -o myfs
 // ./myfs work_dir -f --src fuse/a:fuse/b
+// ./myfs work_dir -f --src fuse/a:fuse/b -o max_idle_threads=4 # -s for a single thread
+// ./myfs work_dir -f --src fuse/a:fuse/b --scan-stats # startup time and index size
+// ./myfs work_dir -f --src fuse/a:fuse/b --mmap 1048576 # map files from 1 MiB up
 // fusermount3 -u work_dir # if not -f
 
 // ls   ==  readdir
@@ -23,7 +26,7 @@
 // Тип off_t является знаковым, и по умолчанию 32-разрядным.
 // Для того, чтобы уметь работать с файлами размером больше 2-х гигабайт,
 // определяется значение переменной препроцессора до подключения заголовочных файлов:
-#define FUSE_USE_VERSION 30 // API version 3.0
+#define FUSE_USE_VERSION 32 // API version 3.2, fuse_loop_config
 #define _FILE_OFFSET_BITS 64
 
 //When applying permissions to directories on Linux, the permission bits have different meanings than on regular files.
@@ -33,14 +36,33 @@
 //The execute bit (x) allows the affected user to enter the directory, and access files and directories inside
 
 // system_clock 's native precision (typically finer than milliseconds).
-
 //#include <fuse3/fuse.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <filesystem>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -48,139 +70,951 @@
 
 namespace fs = std::filesystem;
 
-namespace std {
+namespace task {
 
-template <>
-struct hash<fs::path> {
+// libstdc++ only provides std::hash<fs::path> since GCC 12
+struct PathHash {
     std::size_t operator()(const fs::path& path) const {
         return std::hash<std::string>{}(path.native());
     }
 };
 
-} // namespace std
+constexpr uint32_t kNoNode = UINT32_MAX;
+constexpr uint32_t kRootNode = 0;
 
-namespace task {
+// What getattr reports, without the padding and unused fields of struct stat.
+struct Attributes {
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t size;
+    int64_t blocks;
+    struct timespec atim;
+    struct timespec mtim;
+    struct timespec ctim;
+};
+
+// A virtual path with the attributes of its newest candidate. The full path
+// is not stored: it is the branch directory followed by the virtual path.
+// The node id plus FUSE_ROOT_ID is the inode number.
+struct Node {
+    // kNoNode once removed from the tree
+    uint32_t parent;
+    // offset of the name in Index::names_
+    uint32_t name;
+    uint16_t name_length;
+    // index in full_directories_paths of the newest candidate
+    uint16_t branch;
+    // FNV-1a of the whole virtual path
+    uint32_t hash;
+    // bumped every time the id is reused for another path
+    uint32_t generation;
+    // in free_nodes_
+    bool released;
+    // lookups not yet forgotten by the kernel, a removed node is kept until
+    // they drop to zero; changed with atomics under the shared lock
+    uint64_t lookups;
+    Attributes attributes;
+    // sorted by name once the scan is over
+    std::vector<uint32_t> children;
+};
+
+bool IsNewer(const struct timespec& lhs, const struct timespec& rhs) {
+    return lhs.tv_sec != rhs.tv_sec ? lhs.tv_sec > rhs.tv_sec
+                                    : lhs.tv_nsec > rhs.tv_nsec;
+}
+
+// The merged tree of all branches: nodes in one vector, names in one arena
+// and a flat open-addressing table from the hash of a virtual path to its
+// node. Not synchronized, see tree_mutex.
+class Index {
+public:
+    Index() {
+        nodes_.push_back(Node{kNoNode, 0, 0, 0, kHashBasis, 0, false, 0, {}, {}});
+        names_.push_back('\0');
+        slots_.assign(kMinSlots, kEmptySlot);
+    }
+
+    // Node of a virtual path such as "/a/b", kNoNode if there is none.
+    uint32_t Find(std::string_view path) const {
+        if (path == "/") {
+            return kRootNode;
+        }
+        return Probe(Hash(kHashBasis, path), [&](uint32_t node) {
+            return Matches(node, path);
+        });
+    }
+
+    uint32_t FindChild(uint32_t parent, std::string_view name) const {
+        return Probe(HashChild(nodes_[parent].hash, name), [&](uint32_t node) {
+            return nodes_[node].parent == parent && Name(node) == name;
+        });
+    }
+
+    // Adds name to parent, or makes this candidate the winner if it is newer
+    // than the current one; equal times go to the lower branch.
+    uint32_t AddCandidate(
+        uint32_t parent, std::string_view name, uint16_t branch, const Attributes& attributes) {
+        const uint32_t node = FindChild(parent, name);
+        if (node == kNoNode) {
+            return Insert(parent, name, branch, attributes);
+        }
+        auto& current = nodes_[node];
+        if (IsNewer(attributes.mtim, current.attributes.mtim) ||
+            (!IsNewer(current.attributes.mtim, attributes.mtim) && branch < current.branch)) {
+            current.branch = branch;
+            current.attributes = attributes;
+        }
+        return node;
+    }
+
+    // Adds or overwrites name in parent unconditionally.
+    uint32_t Set(
+        uint32_t parent, std::string_view name, uint16_t branch, const Attributes& attributes) {
+        const uint32_t node = FindChild(parent, name);
+        if (node == kNoNode) {
+            return Insert(parent, name, branch, attributes);
+        }
+        Update(node, branch, attributes);
+        return node;
+    }
+
+    void Update(uint32_t node, uint16_t branch, const Attributes& attributes) {
+        nodes_[node].branch = branch;
+        nodes_[node].attributes = attributes;
+    }
+
+    // Removes node with everything below it.
+    void Remove(uint32_t node) {
+        auto& siblings = nodes_[nodes_[node].parent].children;
+        siblings.erase(std::find(siblings.begin(), siblings.end(), node));
+        RemoveSubtree(node);
+    }
+
+    void Ref(uint32_t node, uint64_t count) {
+        __atomic_add_fetch(&nodes_[node].lookups, count, __ATOMIC_RELAXED);
+    }
+
+    // Returns true if the kernel forgot a node that is no longer in the
+    // tree; it must then be passed to ReleaseDetached under the unique lock.
+    bool Unref(uint32_t node, uint64_t count) {
+        return __atomic_sub_fetch(&nodes_[node].lookups, count, __ATOMIC_RELAXED) == 0 &&
+            nodes_[node].parent == kNoNode && node != kRootNode;
+    }
+
+    void ReleaseDetached(uint32_t node) {
+        const auto& detached = nodes_[node];
+        if (detached.parent == kNoNode && !detached.released && detached.lookups == 0 &&
+            node != kRootNode) {
+            Release(node);
+        }
+    }
+
+    // Virtual path of node, empty if it was removed from the tree.
+    std::string Path(uint32_t node) const {
+        if (node == kRootNode) {
+            return "/";
+        }
+        std::string path;
+        for (; node != kRootNode; node = nodes_[node].parent) {
+            if (nodes_[node].parent == kNoNode) {
+                return {};
+            }
+            path.insert(0, Name(node));
+            path.insert(0, 1, '/');
+        }
+        return path;
+    }
+
+    // Called once after the scan: sorts the children, later insertions keep
+    // the order, and drops the capacity left over from growing.
+    void FinishScan() {
+        nodes_.shrink_to_fit();
+        names_.shrink_to_fit();
+        for (auto& node : nodes_) {
+            node.children.shrink_to_fit();
+            std::sort(node.children.begin(), node.children.end(), [&](uint32_t lhs, uint32_t rhs) {
+                return Name(lhs) < Name(rhs);
+            });
+        }
+        sorted_ = true;
+    }
+
+    const Node& operator[](uint32_t node) const {
+        return nodes_[node];
+    }
+
+    // Null-terminated, valid until the next insertion.
+    std::string_view Name(uint32_t node) const {
+        return {names_.data() + nodes_[node].name, nodes_[node].name_length};
+    }
+
+    size_t Size() const {
+        return nodes_.size() - free_nodes_.size();
+    }
+
+    size_t MemoryUsage() const {
+        size_t bytes = nodes_.capacity() * sizeof(Node) + names_.capacity() +
+            slots_.capacity() * sizeof(uint32_t) + free_nodes_.capacity() * sizeof(uint32_t);
+        for (const auto& node : nodes_) {
+            bytes += node.children.capacity() * sizeof(uint32_t);
+        }
+        return bytes;
+    }
+
+private:
+    static constexpr uint32_t kHashBasis = 2166136261u;
+    static constexpr uint32_t kHashPrime = 16777619u;
+    static constexpr uint32_t kEmptySlot = UINT32_MAX;
+    static constexpr uint32_t kDeletedSlot = UINT32_MAX - 1;
+    static constexpr size_t kMinSlots = 1024;
+
+    static uint32_t Hash(uint32_t hash, std::string_view bytes) {
+        for (const char byte : bytes) {
+            hash = (hash ^ static_cast<uint8_t>(byte)) * kHashPrime;
+        }
+        return hash;
+    }
+
+    // the hash of "parent/name" continues the hash of "parent"
+    static uint32_t HashChild(uint32_t parent_hash, std::string_view name) {
+        return Hash(Hash(parent_hash, "/"), name);
+    }
+
+    // Compares path with the names on the way from node up to the root.
+    bool Matches(uint32_t node, std::string_view path) const {
+        while (node != kRootNode) {
+            const auto& name = Name(node);
+            if (path.size() <= name.size() ||
+                path.compare(path.size() - name.size(), name.size(), name) != 0 ||
+                path[path.size() - name.size() - 1] != '/') {
+                return false;
+            }
+            path.remove_suffix(name.size() + 1);
+            node = nodes_[node].parent;
+        }
+        return path.empty();
+    }
+
+    template <class Predicate>
+    uint32_t Probe(uint32_t hash, Predicate&& matches) const {
+        const size_t mask = slots_.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            const uint32_t node = slots_[slot];
+            if (node == kEmptySlot) {
+                return kNoNode;
+            }
+            if (node != kDeletedSlot && nodes_[node].hash == hash && matches(node)) {
+                return node;
+            }
+        }
+    }
+
+    uint32_t Insert(
+        uint32_t parent, std::string_view name, uint16_t branch, const Attributes& attributes) {
+        uint32_t node;
+        if (free_nodes_.empty()) {
+            node = nodes_.size();
+            nodes_.emplace_back();
+        } else {
+            node = free_nodes_.back();
+            free_nodes_.pop_back();
+        }
+        auto& inserted = nodes_[node];
+        inserted.parent = parent;
+        inserted.released = false;
+        inserted.lookups = 0;
+        inserted.name = names_.size();
+        inserted.name_length = name.size();
+        inserted.branch = branch;
+        inserted.hash = HashChild(nodes_[parent].hash, name);
+        inserted.attributes = attributes;
+        names_.insert(names_.end(), name.begin(), name.end());
+        names_.push_back('\0');
+
+        auto& children = nodes_[parent].children;
+        if (sorted_) {
+            children.insert(
+                std::lower_bound(children.begin(), children.end(), name, [&](uint32_t child, std::string_view name) {
+                    return Name(child) < name;
+                }),
+                node);
+        } else {
+            children.push_back(node);
+        }
+        InsertSlot(node);
+        return node;
+    }
+
+    // Names of removed nodes stay in the arena until the next mount, ids
+    // still known to the kernel are released by its 'forget'.
+    void RemoveSubtree(uint32_t node) {
+        for (const uint32_t child : nodes_[node].children) {
+            RemoveSubtree(child);
+        }
+        const size_t mask = slots_.size() - 1;
+        for (size_t slot = nodes_[node].hash & mask;; slot = (slot + 1) & mask) {
+            if (slots_[slot] == node) {
+                slots_[slot] = kDeletedSlot;
+                break;
+            }
+        }
+        nodes_[node].parent = kNoNode;
+        std::vector<uint32_t>().swap(nodes_[node].children);
+        if (nodes_[node].lookups == 0) {
+            Release(node);
+        }
+    }
+
+    void Release(uint32_t node) {
+        nodes_[node].released = true;
+        ++nodes_[node].generation;
+        free_nodes_.push_back(node);
+    }
+
+    // load factor, deleted slots included, stays below 0.7
+    void InsertSlot(uint32_t node) {
+        if ((used_slots_ + 1) * 10 > slots_.size() * 7) {
+            Rehash();
+        }
+        const size_t mask = slots_.size() - 1;
+        size_t slot = nodes_[node].hash & mask;
+        while (slots_[slot] != kEmptySlot && slots_[slot] != kDeletedSlot) {
+            slot = (slot + 1) & mask;
+        }
+        if (slots_[slot] == kEmptySlot) {
+            ++used_slots_;
+        }
+        slots_[slot] = node;
+    }
+
+    void Rehash() {
+        size_t capacity = kMinSlots;
+        while (capacity * 7 < Size() * 20) {
+            capacity *= 2;
+        }
+        slots_.assign(capacity, kEmptySlot);
+        used_slots_ = 0;
+        const size_t mask = capacity - 1;
+        for (uint32_t node = kRootNode + 1; node < nodes_.size(); ++node) {
+            if (nodes_[node].parent == kNoNode) {
+                continue;
+            }
+            size_t slot = nodes_[node].hash & mask;
+            while (slots_[slot] != kEmptySlot) {
+                slot = (slot + 1) & mask;
+            }
+            slots_[slot] = node;
+            ++used_slots_;
+        }
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_nodes_;
+    std::vector<char> names_;
+    std::vector<uint32_t> slots_;
+    size_t used_slots_ = 0;
+    bool sorted_ = false;
+};
+
+// A directory of one branch watched by inotify.
+struct WatchedDirectory {
+    size_t branch;
+    // virtual path of the directory
+    fs::path path;
+};
+
+// Identity of a branch file version: a file replaced or resized in the
+// branch gets a new mapping, opens of the old one keep theirs.
+struct MappingKey {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    int64_t mtime;
+
+    bool operator==(const MappingKey& other) const {
+        return device == other.device && inode == other.inode && size == other.size &&
+            mtime == other.mtime;
+    }
+};
+
+struct MappingKeyHash {
+    std::size_t operator()(const MappingKey& key) const {
+        return std::hash<uint64_t>{}(key.inode) ^ std::hash<uint64_t>{}(key.device) * 31 ^
+            std::hash<int64_t>{}(key.mtime) * 131;
+    }
+};
+
+// A read-only mapping of a whole file shared by all its opens.
+struct MappedFile {
+    const char* data;
+    size_t length;
+    size_t opens;
+};
+
+// What fi->fh points to; mapping is null for files read with pread.
+struct OpenFile {
+    int fd;
+    MappingKey key;
+    MappedFile* mapping;
+};
+
+// A directory of one branch waiting for the startup scan.
+struct ScanTask {
+    uint16_t branch;
+    uint32_t node;
+    std::string full_path;
+};
+
+// Tasks of one scanner thread: the owner works at the back, the others
+// steal from the front.
+struct ScanQueue {
+    std::mutex mutex;
+    std::deque<ScanTask> tasks;
+};
 
 namespace {
 
 struct Options {
     char* directories_string;
+    int scan_stats;
+    // files of at least this size are served from mappings, 0 turns it off
+    unsigned long mmap_size;
 };
 
+// the kernel may cache for long, the watcher invalidates what changes
+constexpr double kCacheTimeout = 60.0;
+constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+constexpr size_t kEventsBufferSize = 64 * 1024;
+
 Options option{};
 std::vector<fs::path> full_directories_paths;
-std::unordered_map<fs::path, std::vector<fs::path>> filesystem_tree;
+// the merged tree: the scanner and the watcher change it under the unique
+// lock, callbacks read it under the shared one
+std::shared_mutex tree_mutex;
+Index index;
+// used by the scanner before mount and by the watcher thread afterwards only
+int inotify_fd = -1;
+int stop_fd = -1;
+std::unordered_map<int, WatchedDirectory> watches;
+std::thread watcher;
+struct fuse_session* session = nullptr;
+// mappings of the open large files, see --mmap
+std::mutex mappings_mutex;
+std::unordered_map<MappingKey, MappedFile, MappingKeyHash> mappings;
 char cwd[PATH_MAX];
 std::string initial_working_directory;
 
 } // namespace
 
-auto FindLastChanged(const std::vector<fs::path>& paths) {
-    fs::path result = *paths.begin();
-    for (const auto& path : paths) {
-        if (fs::last_write_time(result) < fs::last_write_time(path)) {
-            result = path;
+// Full path of the candidate for a virtual path in a branch.
+fs::path BranchPath(size_t branch, const fs::path& path) {
+    return full_directories_paths[branch].native() + path.native();
+}
+
+// Attributes of a candidate with the mode reduced to read-only.
+Attributes MakeAttributes(const struct stat& st) {
+    Attributes attributes{};
+    attributes.mode = st.st_mode;
+    if (S_ISREG(st.st_mode)) {
+        attributes.mode = S_IFREG | 0444;
+    } else if (S_ISDIR(st.st_mode)) {
+        attributes.mode = S_IFDIR | 0555;
+    }
+    attributes.nlink = st.st_nlink;
+    attributes.uid = st.st_uid;
+    attributes.gid = st.st_gid;
+    attributes.size = st.st_size;
+    attributes.blocks = st.st_blocks;
+    attributes.atim = st.st_atim;
+    attributes.mtim = st.st_mtim;
+    attributes.ctim = st.st_ctim;
+    return attributes;
+}
+
+void FillStat(const Attributes& attributes, struct stat* st) {
+    *st = {};
+    st->st_mode = attributes.mode;
+    st->st_nlink = attributes.nlink;
+    st->st_uid = attributes.uid;
+    st->st_gid = attributes.gid;
+    st->st_size = attributes.size;
+    st->st_blocks = attributes.blocks;
+    st->st_atim = attributes.atim;
+    st->st_mtim = attributes.mtim;
+    st->st_ctim = attributes.ctim;
+}
+
+void AddWatch(size_t branch, const fs::path& path) {
+    if (inotify_fd == -1) {
+        return;
+    }
+    const int wd = inotify_add_watch(inotify_fd, BranchPath(branch, path).c_str(), kWatchMask);
+    if (wd != -1) {
+        watches[wd] = {branch, path};
+    }
+}
+
+// The newest candidate of a virtual path over all branches, if any.
+struct ResolvedEntry {
+    fs::path path;
+    std::optional<std::pair<uint16_t, Attributes>> newest;
+};
+
+// Resolves path again over all branches, as the scan did at mount. Only
+// stats the branches, the tree is not touched.
+ResolvedEntry ResolveEntry(const fs::path& path) {
+    ResolvedEntry entry{path, {}};
+    for (size_t branch = 0; branch < full_directories_paths.size(); ++branch) {
+        struct stat st {};
+        if (stat(BranchPath(branch, entry.path).c_str(), &st) == 0 &&
+            (!entry.newest || IsNewer(st.st_mtim, entry.newest->second.mtim))) {
+            entry.newest.emplace(branch, MakeAttributes(st));
         }
     }
-    return result;
+    return entry;
 }
 
-// callback function to be called after 'stat' system call
-int my_stat(const char* path, struct stat* st, struct fuse_file_info* fi) {
-    const auto& it = filesystem_tree.find(path);
-    if (it == filesystem_tree.end()) {
-        return -ENOENT;
+// Patches the node of a resolved path. Must be called under the unique lock.
+void ApplyEntry(const ResolvedEntry& entry) {
+    const auto& [path, newest] = entry;
+    if (path == "/") {
+        if (newest) {
+            index.Update(kRootNode, newest->first, newest->second);
+        }
+        return;
+    }
+    const uint32_t parent = index.Find(path.parent_path().native());
+    if (parent == kNoNode) {
+        return;
+    }
+    const std::string name = path.filename().native();
+    if (newest) {
+        index.Set(parent, name, newest->first, newest->second);
+    } else if (const uint32_t node = index.FindChild(parent, name); node != kNoNode) {
+        index.Remove(node);
     }
+}
 
-    const auto& full_path = FindLastChanged(it->second);
-    const auto& result = stat(full_path.c_str(), st);
-    if (S_ISREG(st->st_mode)) {
-        st->st_mode = S_IFREG | 0444;
-    } else if (S_ISDIR(st->st_mode)) {
-        st->st_mode = S_IFDIR | 0555;
+// ResolveEntry for a directory that appeared, disappeared or was moved:
+// every name below it is resolved again and new branch directories are
+// watched. Parents come before their children in resolved.
+void ResolveTree(const fs::path& path, std::vector<ResolvedEntry>& resolved) {
+    std::unordered_set<std::string> names;
+    {
+        std::shared_lock lock(tree_mutex);
+        if (const uint32_t node = index.Find(path.native()); node != kNoNode) {
+            for (const uint32_t child : index[node].children) {
+                names.emplace(index.Name(child));
+            }
+        }
+    }
+    for (size_t branch = 0; branch < full_directories_paths.size(); ++branch) {
+        std::error_code error;
+        fs::directory_iterator item(BranchPath(branch, path), error);
+        if (error) {
+            continue;
+        }
+        // the watch goes first, names created during the listing are not lost
+        AddWatch(branch, path);
+        for (; !error && item != fs::directory_iterator(); item.increment(error)) {
+            names.insert(item->path().filename().native());
+        }
     }
 
-    return result;
+    resolved.push_back(ResolveEntry(path));
+    for (const auto& name : names) {
+        ResolveTree(path / name, resolved);
+    }
 }
 
-// callback function to be called after 'readdir' system call
-int my_readdir(
-    const char* path,
-    void* out,
-    fuse_fill_dir_t filler,
-    off_t off,
-    struct fuse_file_info* fi,
-    fuse_readdir_flags flags) {
-    // filler(out, filename, stat, flags) -- заполняет информацию о файле и вставляет её в out
-    // two mandatory entries: the directory itself and its parent
-    filler(out, ".", nullptr, 0, fuse_fill_dir_flags(0));
-    filler(out, "..", nullptr, 0, fuse_fill_dir_flags(0));
-
-    int amount_of_directories = 0;
-    const auto& it = filesystem_tree.find(path);
-    if (it == filesystem_tree.end()) {
-        return -ENOENT;
-    }
-
-    std::unordered_set<std::string> unique_filenames;
-    for (const auto& full_path : it->second) {
-        if (fs::is_directory(fs::status(full_path))) {
-            ++amount_of_directories;
-            // do not need recursive
-            for (const auto& item : fs::directory_iterator(full_path)) {
-                const std::string& item_name = item.path().filename().c_str();
-                if (unique_filenames.find(item_name) ==
-                    unique_filenames.end()) {
-                    unique_filenames.insert(item_name);
-                    filler(
-                        out,
-                        item_name.c_str(),
-                        nullptr,
-                        0,
-                        fuse_fill_dir_flags(0));
-                }
+fuse_ino_t ToInode(uint32_t node) {
+    return fuse_ino_t{node} + FUSE_ROOT_ID;
+}
+
+uint32_t ToNode(fuse_ino_t ino) {
+    return ino - FUSE_ROOT_ID;
+}
+
+// What the kernel has to drop for one changed path.
+struct Invalidation {
+    // attributes and page cache, 0 if the path is gone
+    fuse_ino_t ino;
+    // the name in its parent, 0 for a parent whose listing changed
+    fuse_ino_t parent;
+    std::string name;
+};
+
+// Turns changed paths, plus the directories that contain them, into
+// inode numbers. Must be called under tree_mutex.
+std::vector<Invalidation> CollectInvalidations(const std::vector<fs::path>& changed) {
+    const std::unordered_set<fs::path, PathHash> entries(changed.begin(), changed.end());
+    std::unordered_set<fs::path, PathHash> parents;
+    std::vector<Invalidation> invalidations;
+    for (const auto& path : entries) {
+        const uint32_t node = index.Find(path.native());
+        const uint32_t parent = path == "/" ? kNoNode : index.Find(path.parent_path().native());
+        invalidations.push_back(
+            {node == kNoNode ? 0 : ToInode(node),
+             parent == kNoNode ? 0 : ToInode(parent),
+             path.filename().native()});
+        parents.insert(path.parent_path());
+    }
+    for (const auto& path : parents) {
+        const uint32_t node = index.Find(path.native());
+        if (entries.count(path) == 0 && node != kNoNode) {
+            invalidations.push_back({ToInode(node), 0, {}});
+        }
+    }
+    return invalidations;
+}
+
+// Must be called without tree_mutex: the kernel may call back into us.
+// inval_entry also drops cached negative lookups of names that appeared.
+void Invalidate(const std::vector<Invalidation>& invalidations) {
+    for (const auto& invalidation : invalidations) {
+        // -ENOENT for inodes and names the kernel does not know
+        if (invalidation.ino != 0) {
+            fuse_lowlevel_notify_inval_inode(session, invalidation.ino, 0, 0);
+        }
+        if (invalidation.parent != 0) {
+            fuse_lowlevel_notify_inval_entry(
+                session, invalidation.parent, invalidation.name.c_str(), invalidation.name.size());
+        }
+    }
+}
+
+// Body of the watcher thread: applies inotify events of all branches to the
+// tree until my_destroy signals stop_fd.
+void WatchBranches() {
+    alignas(struct inotify_event) char buffer[kEventsBufferSize];
+    struct pollfd fds[] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        const ssize_t size = read(inotify_fd, buffer, sizeof(buffer));
+        if (size <= 0) {
+            continue;
+        }
+
+        // a batch of events is applied at once, each path is resolved once
+        std::unordered_set<fs::path, PathHash> entries;
+        std::unordered_set<fs::path, PathHash> trees;
+        for (ssize_t offset = 0; offset < size;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, resolve everything again
+                trees.insert("/");
+                continue;
+            }
+            const auto& it = watches.find(event->wd);
+            if (it == watches.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watches.erase(it);
+                continue;
+            }
+            // the directory itself changed its times or link count
+            entries.insert(it->second.path);
+            if (event->len != 0) {
+                const auto& path = it->second.path / event->name;
+                (event->mask & IN_ISDIR ? trees : entries).insert(path);
+            }
+        }
+
+        // the branches are listed and stated without the lock, callbacks
+        // only wait while the results are applied
+        std::vector<ResolvedEntry> resolved;
+        for (const auto& path : trees) {
+            ResolveTree(path, resolved);
+        }
+        for (const auto& path : entries) {
+            resolved.push_back(ResolveEntry(path));
+        }
+        std::vector<fs::path> changed;
+        changed.reserve(resolved.size());
+        std::vector<Invalidation> invalidations;
+        {
+            std::unique_lock lock(tree_mutex);
+            for (const auto& entry : resolved) {
+                ApplyEntry(entry);
+                changed.push_back(entry.path);
             }
+            invalidations = CollectInvalidations(changed);
         }
+        Invalidate(invalidations);
     }
-    if (amount_of_directories == 0) {
-        return -ENOENT;
+}
+
+void my_init(void* userdata, struct fuse_conn_info* conn) {
+    // read hands out file descriptors, let libfuse splice them
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    if (inotify_fd != -1 && stop_fd != -1) {
+        watcher = std::thread(WatchBranches);
     }
-    return 0; // success
 }
 
-// callback function to be called after 'read' system call
-int my_read(
-    const char* path,
-    char* out,
-    size_t size,
-    off_t off,
-    struct fuse_file_info* fi) {
-    const auto& it = filesystem_tree.find(path);
-    if (it == filesystem_tree.end()) {
-        return -ENOENT;
+void my_destroy(void* userdata) {
+    if (watcher.joinable()) {
+        const uint64_t stop = 1;
+        write(stop_fd, &stop, sizeof(stop));
+        watcher.join();
     }
-    // открывать файловый дескриптор заранее или мапить заранее
-    const auto& full_path = FindLastChanged(it->second);
-    if (!fs::is_regular_file(fs::status(full_path))) {
-        return -ENOENT;
+}
+
+// What the kernel caches for node: the kernel may keep it for long, the
+// watcher invalidates what changes.
+void FillEntry(uint32_t node, struct fuse_entry_param* entry) {
+    entry->ino = ToInode(node);
+    entry->generation = index[node].generation;
+    FillStat(index[node].attributes, &entry->attr);
+    entry->attr.st_ino = entry->ino;
+    entry->attr_timeout = kCacheTimeout;
+    entry->entry_timeout = kCacheTimeout;
+}
+
+// callback function to be called when the kernel resolves a name in a directory
+// every positive reply is a lookup the kernel gives back with 'forget'
+void my_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    struct fuse_entry_param entry {};
+    {
+        std::shared_lock lock(tree_mutex);
+        const uint32_t node = index.FindChild(ToNode(parent), name);
+        if (node != kNoNode) {
+            index.Ref(node, 1);
+            FillEntry(node, &entry);
+        }
+    }
+    if (entry.ino == 0) {
+        // ino 0 is a negative entry, the watcher invalidates it if the name appears
+        entry.entry_timeout = kCacheTimeout;
     }
+    fuse_reply_entry(req, &entry);
+}
 
-    if (off + size > fs::file_size(full_path)) {
-        size = fs::file_size(full_path) - off;
+void Forget(fuse_ino_t ino, uint64_t nlookup) {
+    const uint32_t node = ToNode(ino);
+    {
+        std::shared_lock lock(tree_mutex);
+        if (!index.Unref(node, nlookup)) {
+            return;
+        }
     }
-    int fd = open(full_path.c_str(), O_RDONLY, 0);
-    lseek(fd, off, SEEK_SET);
-    read(fd, out, size);
-    close(fd);
+    std::unique_lock lock(tree_mutex);
+    index.ReleaseDetached(node);
+}
+
+// callback function to be called when the kernel drops an inode
+void my_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    Forget(ino, nlookup);
+    fuse_reply_none(req);
+}
 
-    return size;
+void my_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+    for (size_t i = 0; i < count; ++i) {
+        Forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+// callback function to be called after 'stat' system call
+void my_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    struct stat st;
+    {
+        std::shared_lock lock(tree_mutex);
+        FillStat(index[ToNode(ino)].attributes, &st);
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, kCacheTimeout);
+}
+
+void my_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    std::shared_lock lock(tree_mutex);
+    if (!S_ISDIR(index[ToNode(ino)].attributes.mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+// offsets are positions in the listing: 1 and 2 for '.' and '..', then
+// i + 3 for the i-th name, so a full buffer can be continued later
+void ReadDirectory(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus) {
+    std::vector<char> buffer(size);
+    size_t used = 0;
+    std::shared_lock lock(tree_mutex);
+    const uint32_t directory = ToNode(ino);
+    if (!S_ISDIR(index[directory].attributes.mode)) {
+        lock.unlock();
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    // adds one name to the buffer, false when it does not fit
+    const auto add = [&](const char* name, uint32_t node, off_t next) {
+        struct fuse_entry_param entry {};
+        FillEntry(node, &entry);
+        const size_t entry_size = plus
+            ? fuse_add_direntry_plus(req, buffer.data() + used, size - used, name, &entry, next)
+            : fuse_add_direntry(req, buffer.data() + used, size - used, name, &entry.attr, next);
+        if (entry_size > size - used) {
+            return false;
+        }
+        used += entry_size;
+        return true;
+    };
+    // two mandatory entries: the directory itself and its parent
+    const uint32_t parent = index[directory].parent == kNoNode ? directory : index[directory].parent;
+    bool full = off < 1 && !add(".", directory, 1);
+    full = full || (off < 2 && !add("..", parent, 2));
+    // with readdirplus 'ls -l' needs no getattr, and every name but '.'
+    // and '..' counts as a lookup
+    const auto& children = index[directory].children;
+    for (size_t i = std::max<off_t>(off, 2) - 2; !full && i < children.size(); ++i) {
+        full = !add(index.Name(children[i]).data(), children[i], i + 3);
+        if (!full && plus) {
+            index.Ref(children[i], 1);
+        }
+    }
+    lock.unlock();
+    fuse_reply_buf(req, buffer.data(), used);
+}
+
+// callback function to be called after 'readdir' system call
+void my_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+    ReadDirectory(req, ino, size, off, false);
+}
+
+void my_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+    ReadDirectory(req, ino, size, off, true);
+}
+
+// Maps an open branch file if it is at least --mmap bytes, or takes one more
+// reference to its existing mapping. Returns null if the file is read with
+// pread.
+MappedFile* MapFile(int fd, MappingKey* key) {
+    struct stat st {};
+    if (option.mmap_size == 0 || fstat(fd, &st) == -1 ||
+        static_cast<unsigned long>(st.st_size) < option.mmap_size) {
+        return nullptr;
+    }
+    *key = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec};
+    std::lock_guard lock(mappings_mutex);
+    auto [it, inserted] = mappings.try_emplace(*key, MappedFile{nullptr, 0, 0});
+    if (inserted) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            mappings.erase(it);
+            return nullptr;
+        }
+        // start reading the file in ahead of the first reads; no
+        // MADV_SEQUENTIAL, random readers share the mapping and it would
+        // drop the pages behind a sequential one
+        madvise(data, st.st_size, MADV_WILLNEED);
+        it->second = {static_cast<const char*>(data), static_cast<size_t>(st.st_size), 0};
+    }
+    ++it->second.opens;
+    return &it->second;
+}
+
+// Closes an open file and unmaps its mapping after the last open.
+void CloseFile(OpenFile* file) {
+    if (file->mapping != nullptr) {
+        std::lock_guard lock(mappings_mutex);
+        if (--file->mapping->opens == 0) {
+            munmap(const_cast<char*>(file->mapping->data), file->mapping->length);
+            mappings.erase(file->key);
+        }
+    }
+    close(file->fd);
+    delete file;
+}
+
+// callback function to be called after 'open' system call
+// the branch is resolved once, the descriptor lives in fi->fh until release
+void my_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fs::path full_path;
+    {
+        std::shared_lock lock(tree_mutex);
+        const uint32_t node = ToNode(ino);
+        const auto& path = index.Path(node);
+        if (!S_ISREG(index[node].attributes.mode) || path.empty()) {
+            lock.unlock();
+            fuse_reply_err(req, path.empty() ? ENOENT : EISDIR);
+            return;
+        }
+        full_path = BranchPath(index[node].branch, path);
+    }
+    const int fd = open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    auto* file = new OpenFile{fd, {}, nullptr};
+    file->mapping = MapFile(fd, &file->key);
+    fi->fh = reinterpret_cast<uint64_t>(file);
+    // the watcher invalidates the page cache when the file changes
+    fi->keep_cache = 1;
+    // an interrupted open gets no release
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        CloseFile(file);
+    }
+}
+
+// callback function to be called after the last 'close' of a file
+void my_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    CloseFile(reinterpret_cast<OpenFile*>(fi->fh));
+    fuse_reply_err(req, 0);
+}
+
+// callback function to be called after 'read' system call
+// a mapped file is replied straight from the mapping, without a syscall
+// per chunk; otherwise libfuse gets the descriptor instead of the data, so
+// it can read or splice the file straight into /dev/fuse; no locks, fi->fh
+// is ours
+void my_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+    const auto* file = reinterpret_cast<const OpenFile*>(fi->fh);
+    // the file may have grown since it was mapped, the tail is read with pread
+    if (file->mapping != nullptr && static_cast<size_t>(off) < file->mapping->length) {
+        fuse_reply_buf(req, file->mapping->data + off, std::min(size, file->mapping->length - off));
+        return;
+    }
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = file->fd;
+    buf.buf[0].pos = off;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
 }
 
 // register functions as callbacks
-struct cpp_fuse_operations : fuse_operations {
-    cpp_fuse_operations() : fuse_operations() {
+struct cpp_fuse_lowlevel_operations : fuse_lowlevel_ops {
+    cpp_fuse_lowlevel_operations() : fuse_lowlevel_ops() {
+        init = my_init;
+        destroy = my_destroy;
+        lookup = my_lookup;
+        forget = my_forget;
+        forget_multi = my_forget_multi;
+        getattr = my_getattr;
+        opendir = my_opendir;
         readdir = my_readdir;
-        getattr = my_stat;
+        readdirplus = my_readdirplus;
+        open = my_open;
+        release = my_release;
         read = my_read;
     }
 } operations;
@@ -206,32 +1040,155 @@ void SplitDirectories() {
     }
 }
 
-fs::path DeletePrefix(const fs::path& path, const fs::path& prefix) {
-    return {std::string(path.c_str() + prefix.native().size())};
-}
+// Reads one directory of a branch with one fstatat per name relative to the
+// directory, then adds everything to the index in a single locked pass.
+void ScanDirectory(const ScanTask& task, std::vector<ScanTask>& subdirectories) {
+    struct ScannedEntry {
+        std::string name;
+        Attributes attributes;
+        bool is_directory;
+    };
 
-void MakeFilesystemTree() {
-    for (const auto& full_directory_path : full_directories_paths) {
-        for (const auto& full_path :
-             fs::recursive_directory_iterator(full_directory_path)) {
-            filesystem_tree[DeletePrefix(full_path, full_directory_path)]
-                .push_back(full_path);
+    // the watch goes first, names created during the scan are not lost
+    const int wd = inotify_fd == -1
+        ? -1
+        : inotify_add_watch(inotify_fd, task.full_path.c_str(), kWatchMask);
+    DIR* directory = opendir(task.full_path.c_str());
+    if (directory == nullptr) {
+        return;
+    }
+    std::vector<ScannedEntry> scanned;
+    while (const struct dirent* item = readdir(directory)) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st {};
+        if (fstatat(dirfd(directory), item->d_name, &st, 0) == -1) {
+            continue;
+        }
+        // symlinks to directories are not followed, as recursive_directory_iterator did
+        bool is_directory = item->d_type == DT_DIR;
+        if (item->d_type == DT_UNKNOWN) {
+            struct stat link {};
+            is_directory = fstatat(dirfd(directory), item->d_name, &link, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISDIR(link.st_mode);
+        }
+        scanned.push_back({item->d_name, MakeAttributes(st), is_directory});
+    }
+    closedir(directory);
+
+    std::unique_lock lock(tree_mutex);
+    if (wd != -1) {
+        const auto& path = task.full_path.substr(full_directories_paths[task.branch].native().size());
+        watches[wd] = {task.branch, path.empty() ? "/" : path};
+    }
+    for (const auto& item : scanned) {
+        const uint32_t node = index.AddCandidate(task.node, item.name, task.branch, item.attributes);
+        if (item.is_directory) {
+            subdirectories.push_back({task.branch, node, task.full_path + '/' + item.name});
         }
-        filesystem_tree["/"].push_back(full_directory_path / "");
     }
 }
 
-//void CoutFilesystem() {
-//    for (auto [my_path, map] : filesystem_tree) {
-//        std::cout << my_path;
-////        std::chrono::time_point<std::chrono::system_clock, std::chrono::seconds> time_point;
-////        time_point = std::chrono::time_point_cast<std::chrono::seconds>;
-//        for (auto real_path : map) {
-//            std::cout << "\n   " << real_path;
-//        }
-//        std::endl(std::cout);
-//    }
-//}
+// Builds the index at mount with a thread per core. Branches are dealt to
+// the threads, threads that run out of directories steal them from the
+// others, so one huge branch is scanned by all of them. A thread with
+// nothing to steal sleeps until directories are queued or the scan ends.
+void ScanBranches() {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<ScanQueue> queues(threads);
+    // tasks queued or being scanned, the scan is over when none are left
+    std::atomic<size_t> pending = 0;
+    // tasks queued only, and the threads waiting for them
+    std::atomic<size_t> queued = 0;
+    std::atomic<size_t> sleeping = 0;
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    // a sleeper counts itself before it looks at queued and pending, so
+    // either it sees the change or the change sees it
+    const auto wake = [&] {
+        if (sleeping != 0) {
+            { std::lock_guard lock(idle_mutex); }
+            idle.notify_all();
+        }
+    };
+
+    ApplyEntry(ResolveEntry("/"));
+    for (size_t branch = 0; branch < full_directories_paths.size(); ++branch) {
+        queues[branch % threads].tasks.push_back(
+            {static_cast<uint16_t>(branch), kRootNode, full_directories_paths[branch].native()});
+        ++pending;
+        ++queued;
+    }
+
+    const auto scan = [&](size_t self) {
+        std::vector<ScanTask> subdirectories;
+        while (pending != 0) {
+            std::optional<ScanTask> task;
+            for (size_t i = 0; i < threads && !task; ++i) {
+                auto& queue = queues[(self + i) % threads];
+                std::lock_guard lock(queue.mutex);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                if (i == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                --queued;
+            }
+            if (!task) {
+                std::unique_lock lock(idle_mutex);
+                ++sleeping;
+                idle.wait(lock, [&] { return queued != 0 || pending == 0; });
+                --sleeping;
+                continue;
+            }
+
+            ScanDirectory(*task, subdirectories);
+            pending += subdirectories.size();
+            if (!subdirectories.empty()) {
+                {
+                    std::lock_guard lock(queues[self].mutex);
+                    std::move(
+                        subdirectories.begin(),
+                        subdirectories.end(),
+                        std::back_inserter(queues[self].tasks));
+                }
+                queued += subdirectories.size();
+                subdirectories.clear();
+                wake();
+            }
+            if (--pending == 0) {
+                wake();
+            }
+        }
+    };
+    std::vector<std::thread> scanners;
+    for (size_t i = 1; i < threads; ++i) {
+        scanners.emplace_back(scan, i);
+    }
+    scan(0);
+    for (auto& scanner : scanners) {
+        scanner.join();
+    }
+    index.FinishScan();
+
+    if (option.scan_stats) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "scanned " << index.Size() << " entries of "
+                  << full_directories_paths.size() << " branches with " << threads
+                  << " threads in " << std::fixed << std::setprecision(3)
+                  << elapsed.count() << " s, index takes " << index.MemoryUsage()
+                  << " bytes, " << std::setprecision(1)
+                  << static_cast<double>(index.MemoryUsage()) / index.Size()
+                  << " per entry\n";
+    }
+}
 
 } // namespace task
 
@@ -240,20 +1197,81 @@ int main(int argc, char* argv[]) {
 
     const struct fuse_opt options_specifications[] = {
         {"--src %s", offsetof(task::Options, directories_string), 0},
+        {"--scan-stats", offsetof(task::Options, scan_stats), 1},
+        {"--mmap %lu", offsetof(task::Options, mmap_size), 0},
         FUSE_OPT_END};
 
     // parse command line arguments, store matched by 'options_specifications'
     // options to 'option' value and remove them from {argc, argv}
     fuse_opt_parse(&args, &task::option, options_specifications, nullptr);
 
+    // the standard options: mountpoint, -f, -s, -d, -o clone_fd, -o max_idle_threads=N
+    struct fuse_cmdline_opts cmdline_options {};
+    if (fuse_parse_cmdline(&args, &cmdline_options) != 0) {
+        return 1;
+    }
+    if (cmdline_options.show_help || cmdline_options.show_version) {
+        if (cmdline_options.show_help) {
+            std::cout << "usage: " << argv[0]
+                      << " [options] <mountpoint> --src DIR_1:...:DIR_N [--scan-stats] [--mmap MIN_SIZE]\n\n";
+            fuse_cmdline_help();
+            fuse_lowlevel_help();
+        } else {
+            fuse_lowlevel_version();
+        }
+        fuse_opt_free_args(&args);
+        return 0;
+    }
+    if (cmdline_options.mountpoint == nullptr || task::option.directories_string == nullptr) {
+        std::cerr << "usage: " << argv[0] << " [options] <mountpoint> --src DIR_1:...:DIR_N\n";
+        free(cmdline_options.mountpoint);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
     getcwd(task::cwd, sizeof(task::cwd));
     task::initial_working_directory = task::cwd;
 
     task::SplitDirectories();
-    task::MakeFilesystemTree();
+    if (task::full_directories_paths.size() > UINT16_MAX) {
+        std::cerr << "too many directories in --src\n";
+        free(cmdline_options.mountpoint);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    // watches are added during the scan, so nothing is missed before mount
+    task::inotify_fd = inotify_init1(IN_CLOEXEC);
+    task::stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (task::inotify_fd == -1 || task::stop_fd == -1) {
+        std::cerr << "inotify is unavailable, changes in branches are not tracked\n";
+    }
+    task::ScanBranches();
 
-    const int ret = fuse_main(args.argc, args.argv, &task::operations, nullptr);
+    int ret = 1;
+    task::session =
+        fuse_session_new(&args, &task::operations, sizeof(task::operations), nullptr);
+    if (task::session != nullptr) {
+        if (fuse_set_signal_handlers(task::session) == 0) {
+            if (fuse_session_mount(task::session, cmdline_options.mountpoint) == 0) {
+                fuse_daemonize(cmdline_options.foreground);
+                if (cmdline_options.singlethread) {
+                    ret = fuse_session_loop(task::session);
+                } else {
+                    // workers are started while all are busy, so concurrent
+                    // reads run in parallel; idle ones above the limit exit
+                    struct fuse_loop_config config {};
+                    config.clone_fd = cmdline_options.clone_fd;
+                    config.max_idle_threads = cmdline_options.max_idle_threads;
+                    ret = fuse_session_loop_mt(task::session, &config);
+                }
+                fuse_session_unmount(task::session);
+            }
+            fuse_remove_signal_handlers(task::session);
+        }
+        fuse_session_destroy(task::session);
+    }
 
+    free(cmdline_options.mountpoint);
     fuse_opt_free_args(&args);
     return ret;
-}
\ No newline at end of file
+}
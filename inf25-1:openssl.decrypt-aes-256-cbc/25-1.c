@@ -14,11 +14,57 @@
 // openssl enc -aes-256-cbc -in unsecure.txt -out encrypted.txt -pass pass:password
 // gcc 25-1.c `pkg-config openssl --cflags --libs` -o decipher
 // cat encrypted.txt | ./decipher password
+// cat encrypted.txt | ./decipher password 4 # threads, all cores by default
+// ./decipher password < encrypted.txt > decrypted.txt # mmap of both files
+// ./decipher password --batch restore.list 8 # lines "encrypted decrypted", 8 files at a time
+// ./decipher -e password < unsecure.txt > encrypted.txt # as the openssl enc above
+// openssl enc -aes-256-ctr -pbkdf2 -iter 100000 -in unsecure.txt -pass pass:password | ./decipher -m ctr -i 100000 password
+// ./decipher -e -m gcm password < unsecure.txt | ./decipher -m gcm password
+// ./decipher --benchmark=256m # MB/s per mode, buffer size and thread count against the 256-byte loop
+
+// CBC decryption of a block needs only it and the previous ciphertext block,
+// so the input is read in batches of kSegmentSize segments per thread and
+// every worker decrypts its segment with the last block before it as the IV.
+// The main thread reads the next batch and writes the previous one while
+// the workers decrypt the current batch, output stays in input order.
+//
+// A regular file on stdin is mapped instead of read, the batches point into
+// the mapping. The output goes straight into a mapping of stdout if it is
+// a regular file too, into pages handed to a pipe with vmsplice, or else is
+// written a batch at a time.
+//
+// In batch mode a pool of threads takes the files of a list one by one, each
+// file is decrypted by one thread with a context it reuses. Keys derived
+// from the salts are remembered, files encrypted with the same salt skip
+// the key derivation.
+//
+// -e encrypts into the same "Salted__" format. CBC encryption chains every
+// block to the previous one, so it runs on one worker; CTR is parallel both
+// ways, a segment starts from the IV plus its block number. openssl enc has
+// no AEAD modes, so GCM uses its own format after the header: records of
+// kSegmentSize bytes each followed by its tag, the last one shorter (maybe
+// empty) and marked as the last in its additional data. Every record has
+// its own nonce, is checked before it is output and truncation is caught.
+
+#define _GNU_SOURCE // vmsplice
 
 #include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #define CHECK_ON_VALUE(WHAT_TO_CHECK, VALUE, ERROR) \
@@ -27,63 +73,1166 @@
         exit(errno);                                \
     }
 
-#define kMaxSize 256
+#define kSegmentSize (1 << 20)
+#define kMaxThreads 64
+#define kBlockSize 16
+#define kKeySize 32
+#define kSaltSize 8
+#define kKeyCacheSize 256
+#define kNonceSize 12
+#define kTagSize 16
+#define kDefaultBenchmarkSize (64 << 20)
 
-int main(int argc, char** argv) {
-    assert(argc == 2);
-    const unsigned char* password = argv[1];
+enum cipher_mode {
+    kCbcMode,
+    kCtrMode,
+    kGcmMode,
+};
+
+enum input_mode {
+    kReadInput,
+    kMappedInput,
+};
+
+enum output_mode {
+    kWrittenOutput,
+    kSplicedOutput,
+    kMappedOutput,
+};
+
+// Input taken at once and its output; two of them take turns.
+typedef struct {
+    // into the input mapping or in_buffer
+    const unsigned char* in;
+    // into the output mapping, a fresh mapping for vmsplice or out_buffer
+    unsigned char* out;
+    unsigned char* in_buffer;
+    unsigned char* out_buffer;
+    size_t length;
+    size_t out_length;
+    // of the batch in the input after the header
+    size_t offset;
+    // the ciphertext block before the batch
+    unsigned char iv[kBlockSize];
+} batch_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    EVP_CIPHER_CTX* context;
+    // of the last batch, the main thread fails with it after the batch
+    const char* error;
+    // a decrypted GCM record waits here for its tag if the output is mapped
+    unsigned char* scratch;
+} worker_t;
+
+static struct {
+    bool encrypt;
+    enum cipher_mode mode;
+    // PBKDF2 iterations, 0 for EVP_BytesToKey
+    int iterations;
+    const char* batch_list;
+    size_t benchmark_size;
+} options;
+
+static struct {
+    enum input_mode mode;
+    const unsigned char* mapping;
+    size_t mapping_length;
+    // the input after the header, its length is known if it is mapped
+    const unsigned char* data;
+    size_t length;
+    // how much of it is taken
+    size_t offset;
+} input;
+
+static struct {
+    enum output_mode mode;
+    // opened for reading and writing, mmap needs it
+    int fd;
+    unsigned char* mapping;
+    size_t mapping_length;
+    // file offset of the output and of the mapping, a page boundary
+    off_t start;
+    off_t mapping_start;
+    size_t offset;
+    // the file is at its longest length until finish_output
+    bool unfinished;
+} output;
+
+// One password per run, so a derived key depends on the salt only.
+typedef struct {
+    bool used;
+    unsigned char salt[kSaltSize];
+    unsigned char key[kKeySize];
+    unsigned char iv[kBlockSize];
+} derived_key_t;
+
+typedef struct {
+    char* input;
+    char* output;
+} file_pair_t;
+
+typedef struct {
+    pthread_t thread;
+    EVP_CIPHER_CTX* context;
+    unsigned char* ciphered;
+    unsigned char* deciphered;
+} file_worker_t;
+
+typedef struct {
+    pthread_t thread;
+    enum cipher_mode mode;
+    bool encrypt;
+    size_t buffer_size;
+    const unsigned char* data;
+    size_t length;
+} benchmark_thread_t;
+
+static const unsigned char* password;
+static derived_key_t key_cache[kKeyCacheSize];
+static pthread_mutex_t key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static file_pair_t* file_pairs;
+static size_t file_pairs_count;
+static atomic_size_t next_file_pair;
+static atomic_size_t finished_files;
+static atomic_size_t failed_files;
+static atomic_size_t deciphered_bytes;
+// of the decrypted files, as open with 0644 would give
+static mode_t output_file_mode;
+
+static int workers_count;
+static batch_t* current_batch;
+static bool stopping;
+// the main thread and the workers meet at it before and after every batch
+static pthread_barrier_t barrier;
+// derived with the key, CBC and CTR start from it, GCM nonces are made of it
+static unsigned char stream_iv[kBlockSize];
+
+static ssize_t read_full(int fd, unsigned char* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t result = read(fd, buffer + done, size - done);
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        done += result;
+    }
+    return done;
+}
+
+static int write_full(int fd, const unsigned char* buffer, size_t size) {
+    while (size > 0) {
+        const ssize_t result = write(fd, buffer, size);
+        if (result == -1) {
+            return -1;
+        }
+        buffer += result;
+        size -= result;
+    }
+    return 0;
+}
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static size_t parse_size(const char* value) {
+    char* end;
+    size_t size = strtoull(value, &end, 10);
+    switch (*end) {
+    case 'g':
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'm':
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'k':
+    case 'K':
+        size *= 1024;
+        break;
+    }
+    return size;
+}
+
+static const EVP_CIPHER* cipher_of(enum cipher_mode mode) {
+    switch (mode) {
+    case kCtrMode:
+        return EVP_aes_256_ctr();
+    case kGcmMode:
+        return EVP_aes_256_gcm();
+    case kCbcMode:
+        break;
+    }
+    return EVP_aes_256_cbc();
+}
+
+// EVP_BytesToKey with SHA-256 and one iteration as openssl enc does, or
+// PBKDF2 as openssl enc -pbkdf2 -iter N does; memoized by the salt.
+static void derive_key(const unsigned char* salt, unsigned char* key, unsigned char* iv) {
+    size_t slot = 0;
+    for (int i = 0; i < kSaltSize; ++i) {
+        slot = slot * 131 + salt[i];
+    }
+    derived_key_t* cached = &key_cache[slot % kKeyCacheSize];
+
+    pthread_mutex_lock(&key_cache_mutex);
+    if (cached->used && memcmp(cached->salt, salt, kSaltSize) == 0) {
+        memcpy(key, cached->key, kKeySize);
+        memcpy(iv, cached->iv, kBlockSize);
+        pthread_mutex_unlock(&key_cache_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&key_cache_mutex);
+
+    if (options.iterations > 0) {
+        unsigned char derived[kKeySize + kBlockSize];
+        CHECK_ON_VALUE(PKCS5_PBKDF2_HMAC((const char*)password, strlen((const char*)password),
+                                         salt, kSaltSize, options.iterations, EVP_sha256(),
+                                         sizeof(derived), derived),
+                       0, "PKCS5_PBKDF2_HMAC");
+        memcpy(key, derived, kKeySize);
+        memcpy(iv, derived + kKeySize, kBlockSize);
+    } else {
+        // Генерация ключа и начального вектора из
+        // пароля произвольной длины и 8-байтной соли
+        EVP_BytesToKey(
+            EVP_aes_256_cbc(),    // алгоритм шифрования
+            EVP_sha256(),         // алгоритм хеширования пароля
+            salt,                 // соль
+            password, strlen((const char*)password), // пароль
+            1,                    // количество итераций хеширования
+            key,          // результат: ключ нужной длины
+            iv            // результат: начальный вектор нужной длины
+        );
+    }
+
+    pthread_mutex_lock(&key_cache_mutex);
+    cached->used = true;
+    memcpy(cached->salt, salt, kSaltSize);
+    memcpy(cached->key, key, kKeySize);
+    memcpy(cached->iv, iv, kBlockSize);
+    pthread_mutex_unlock(&key_cache_mutex);
+}
+
+// Input bytes of the unit the workers split a batch by.
+static size_t unit_size(void) {
+    if (options.mode != kGcmMode) {
+        return kBlockSize;
+    }
+    return options.encrypt ? kSegmentSize : kSegmentSize + kTagSize;
+}
+
+// Output of length input bytes taken from a unit boundary, before the CBC
+// padding is added or removed.
+static size_t output_length(size_t length) {
+    switch (options.mode) {
+    case kGcmMode: {
+        const size_t records = (length + unit_size() - 1) / unit_size();
+        if (options.encrypt) {
+            return length + records * kTagSize;
+        }
+        return records * kTagSize > length ? 0 : length - records * kTagSize;
+    }
+    case kCbcMode:
+        return options.encrypt ? length / kBlockSize * kBlockSize : length;
+    case kCtrMode:
+        break;
+    }
+    return length;
+}
+
+// Output of the whole input of length bytes, at most.
+static size_t max_output_length(size_t length) {
+    if (options.encrypt && options.mode == kCbcMode) {
+        return length / kBlockSize * kBlockSize + kBlockSize;
+    }
+    if (options.encrypt && options.mode == kGcmMode) {
+        return length + (length / kSegmentSize + 1) * kTagSize;
+    }
+    return length;
+}
+
+// Counter block of a CTR stream at a block: the IV plus the block number,
+// as one 128-bit big-endian integer.
+static void ctr_counter(const unsigned char* iv, uint64_t block, unsigned char* counter) {
+    unsigned carry = 0;
+    for (int i = kBlockSize - 1; i >= 0; --i) {
+        const unsigned sum = iv[i] + (unsigned)(block & 0xff) + carry;
+        counter[i] = sum;
+        carry = sum >> 8;
+        block >>= 8;
+    }
+}
+
+// Encrypts or decrypts one GCM record. The nonce is the IV with the record
+// number mixed into its last 8 bytes, the additional data says if it is the
+// last record. A ciphertext record ends with its tag, false if it does not
+// match.
+static bool gcm_record(EVP_CIPHER_CTX* context, bool encrypt, const unsigned char* iv,
+                       uint64_t index, bool last, const unsigned char* in, size_t length,
+                       unsigned char* out) {
+    unsigned char nonce[kNonceSize];
+    memcpy(nonce, iv, kNonceSize);
+    for (int i = 0; i < 8; ++i) {
+        nonce[kNonceSize - 1 - i] ^= index >> (8 * i);
+    }
+    if (!encrypt) {
+        if (length < kTagSize) {
+            return false;
+        }
+        length -= kTagSize;
+    }
+    const unsigned char flag = last;
+    int written;
+    if (!EVP_CipherInit_ex(context, NULL, NULL, NULL, nonce, -1) ||
+        !EVP_CipherUpdate(context, NULL, &written, &flag, 1) ||
+        (length > 0 && !EVP_CipherUpdate(context, out, &written, in, length))) {
+        return false;
+    }
+    if (!encrypt &&
+        !EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_TAG, kTagSize, (void*)(in + length))) {
+        return false;
+    }
+    if (!EVP_CipherFinal_ex(context, out + length, &written)) {
+        return false;
+    }
+    return !encrypt || EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, kTagSize, out + length);
+}
+
+static void setup_input(void) {
+    input.mode = kReadInput;
+    struct stat st;
+    const off_t position = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode) || position == -1 ||
+        st.st_size <= position) {
+        return;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (mapping == MAP_FAILED) {
+        return;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    input.mode = kMappedInput;
+    input.mapping = mapping;
+    input.mapping_length = st.st_size;
+    input.data = input.mapping + position;
+    input.length = st.st_size - position;
+}
+
+// Any exit before finish_output is a failure: the mapped output file is
+// cut back to where the output starts instead of being left at its longest
+// length with what the workers had written. Only the main thread exits
+// while the workers may write, they wait for it at the barrier.
+static void discard_output(void) {
+    if (output.unfinished) {
+        ftruncate(output.fd, output.start);
+    }
+}
+
+// A mapping of stdout needs a mapped input to be sized, it is made for the
+// longest output and the file is cut to the real length at the end.
+static void setup_output(void) {
+    output.mode = kWrittenOutput;
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == -1) {
+        return;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        output.mode = kSplicedOutput;
+        return;
+    }
+    const int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    output.start = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (input.mode != kMappedInput || !S_ISREG(st.st_mode) || flags == -1 ||
+        (flags & O_APPEND) || output.start == -1) {
+        return;
+    }
+    // stdout is usually write-only, a shared writable mapping needs O_RDWR
+    output.fd = open("/proc/self/fd/1", O_RDWR | O_CLOEXEC);
+    if (output.fd == -1) {
+        return;
+    }
+    const size_t length = max_output_length(input.length);
+    output.mapping_start = output.start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    output.mapping_length = output.start - output.mapping_start + length;
+    void* mapping = MAP_FAILED;
+    if (ftruncate(output.fd, output.start + length) == 0) {
+        mapping = mmap(NULL, output.mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       output.fd, output.mapping_start);
+    }
+    if (mapping == MAP_FAILED) {
+        ftruncate(output.fd, output.start);
+        close(output.fd);
+        return;
+    }
+    output.mode = kMappedOutput;
+    output.mapping = mapping;
+    output.unfinished = true;
+    atexit(discard_output);
+}
+
+// Takes up to batch_size bytes of the input and a place for their output,
+// returns how many were taken.
+static size_t take_batch(batch_t* batch, size_t batch_size, size_t out_capacity) {
+    batch->offset = input.offset;
+    if (input.mode == kMappedInput) {
+        batch->in = input.data + input.offset;
+        batch->length = input.length - input.offset < batch_size
+            ? input.length - input.offset
+            : batch_size;
+    } else {
+        batch->in = batch->in_buffer;
+        const ssize_t result = read_full(STDIN_FILENO, batch->in_buffer, batch_size);
+        CHECK_ON_VALUE(result, -1, "read");
+        batch->length = result;
+    }
+    input.offset += batch->length;
+    if (batch->length == 0) {
+        return 0;
+    }
+    batch->out_length = output_length(batch->length);
+
+    switch (output.mode) {
+    case kMappedOutput:
+        batch->out = output.mapping + (output.start - output.mapping_start) + output.offset;
+        output.offset += batch->out_length;
+        break;
+    case kSplicedOutput:
+        // the pipe keeps references to the pages, so they are never reused
+        batch->out = mmap(NULL, out_capacity, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CHECK_ON_VALUE(batch->out, MAP_FAILED, "mmap");
+        break;
+    case kWrittenOutput:
+        batch->out = batch->out_buffer;
+        break;
+    }
+    return batch->length;
+}
+
+// Outputs bytes that are not in a batch, after all batches.
+static void put_bytes(const unsigned char* bytes, size_t length) {
+    if (output.mode == kMappedOutput) {
+        memcpy(output.mapping + (output.start - output.mapping_start) + output.offset, bytes,
+               length);
+        output.offset += length;
+        return;
+    }
+    CHECK_ON_VALUE(write_full(STDOUT_FILENO, bytes, length), -1, "write");
+}
+
+// Outputs a batch, its length may be cut by the padding.
+static void put_batch(batch_t* batch, size_t out_capacity) {
+    switch (output.mode) {
+    case kMappedOutput:
+        break;
+    case kSplicedOutput: {
+        struct iovec iov = {batch->out, batch->out_length};
+        while (iov.iov_len > 0) {
+            const ssize_t result = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_GIFT);
+            CHECK_ON_VALUE(result, -1, "vmsplice");
+            iov.iov_base = (unsigned char*)iov.iov_base + result;
+            iov.iov_len -= result;
+        }
+        munmap(batch->out, out_capacity);
+        break;
+    }
+    case kWrittenOutput:
+        CHECK_ON_VALUE(write_full(STDOUT_FILENO, batch->out, batch->out_length), -1, "write");
+        break;
+    }
+}
+
+// Cuts a mapped output file to the output and moves stdout past it.
+static void finish_output(size_t length) {
+    if (output.mode != kMappedOutput) {
+        return;
+    }
+    munmap(output.mapping, output.mapping_length);
+    CHECK_ON_VALUE(ftruncate(output.fd, output.start + length), -1, "ftruncate");
+    output.unfinished = false;
+    lseek(STDOUT_FILENO, output.start + length, SEEK_SET);
+    close(output.fd);
+}
+
+static void fail(const char* message) {
+    fprintf(stderr, "%s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+// Encrypts or decrypts the worker's share of units of the current batch,
+// returns an error message or NULL.
+static const char* process_share(worker_t* worker, batch_t* batch) {
+    int written;
+    if (options.mode == kCbcMode && options.encrypt) {
+        // chained through the context from batch to batch
+        if (worker->index == 0 &&
+            !EVP_CipherUpdate(worker->context, batch->out, &written, batch->in, batch->length)) {
+            return "EVP_CipherUpdate";
+        }
+        return NULL;
+    }
+
+    const size_t unit = unit_size();
+    const size_t units = (batch->length + unit - 1) / unit;
+    const size_t first = units * worker->index / workers_count;
+    const size_t last = units * (worker->index + 1) / workers_count;
+    if (first == last) {
+        return NULL;
+    }
+    const size_t begin = first * unit;
+    const size_t end = last * unit < batch->length ? last * unit : batch->length;
+
+    if (options.mode == kGcmMode) {
+        const size_t out_unit = options.encrypt ? unit + kTagSize : unit - kTagSize;
+        for (size_t i = first; i < last; ++i) {
+            const size_t length = i + 1 < units ? unit : batch->length - i * unit;
+            unsigned char* out = batch->out + i * out_unit;
+            if (!gcm_record(worker->context, options.encrypt, stream_iv, batch->offset / unit + i,
+                            length < unit, batch->in + i * unit, length,
+                            worker->scratch != NULL ? worker->scratch : out)) {
+                return options.encrypt ? "EVP_CipherFinal_ex" : "bad tag";
+            }
+            if (worker->scratch != NULL) {
+                memcpy(out, worker->scratch, length - kTagSize);
+            }
+        }
+        return NULL;
+    }
+
+    unsigned char iv[kBlockSize];
+    if (options.mode == kCtrMode) {
+        ctr_counter(stream_iv, (batch->offset + begin) / kBlockSize, iv);
+    } else {
+        memcpy(iv, begin == 0 ? batch->iv : batch->in + begin - kBlockSize, kBlockSize);
+    }
+    if (!EVP_CipherInit_ex(worker->context, NULL, NULL, NULL, iv, -1)) {
+        return "EVP_CipherInit_ex";
+    }
+    if (!EVP_CipherUpdate(worker->context, batch->out + begin, &written, batch->in + begin,
+                          end - begin)) {
+        return "EVP_CipherUpdate";
+    }
+    return NULL;
+}
+
+static void* worker_routine(void* argument) {
+    worker_t* worker = argument;
+    while (true) {
+        pthread_barrier_wait(&barrier);
+        if (stopping) {
+            return NULL;
+        }
+        worker->error = process_share(worker, current_batch);
+        pthread_barrier_wait(&barrier);
+    }
+}
+
+// Strips the PKCS#7 padding as EVP_DecryptFinal_ex does, -1 if it is broken.
+static ssize_t unpadded_length(const unsigned char* deciphered, size_t length) {
+    if (length == 0) {
+        return -1;
+    }
+    const unsigned char padding = deciphered[length - 1];
+    if (padding == 0 || padding > kBlockSize) {
+        return -1;
+    }
+    for (size_t i = length - padding; i < length; ++i) {
+        if (deciphered[i] != padding) {
+            return -1;
+        }
+    }
+    return length - padding;
+}
+
+// Encrypts or decrypts stdin to stdout with all workers on every batch.
+static void process_stream(void) {
+    // "Salted__" and the salt
+    unsigned char header[8 + kSaltSize];
+    if (options.encrypt) {
+        memcpy(header, "Salted__", 8);
+        CHECK_ON_VALUE((RAND_bytes(header + 8, kSaltSize) == 1), false, "RAND_bytes");
+        CHECK_ON_VALUE(write_full(STDOUT_FILENO, header, sizeof(header)), -1, "write");
+    } else if (read_full(STDIN_FILENO, header, sizeof(header)) != sizeof(header)) {
+        fail("no salt");
+    }
+    unsigned char key[kKeySize];
+    derive_key(header + 8, key, stream_iv);
+
+    // every worker keeps its context with the key schedule, only the IV
+    // changes per segment; the padding is removed once at the end
+    worker_t workers[kMaxThreads];
+    for (int i = 0; i < workers_count; ++i) {
+        workers[i].index = i;
+        workers[i].error = NULL;
+        workers[i].scratch = NULL;
+        workers[i].context = EVP_CIPHER_CTX_new();
+        CHECK_ON_VALUE(workers[i].context, NULL, "new");
+        CHECK_ON_VALUE(EVP_CipherInit_ex(workers[i].context, cipher_of(options.mode), NULL, key,
+                                         options.mode == kGcmMode ? NULL : stream_iv,
+                                         options.encrypt),
+                       0, "EVP_CipherInit_ex");
+        if (options.mode == kCbcMode && !options.encrypt) {
+            EVP_CIPHER_CTX_set_padding(workers[i].context, 0);
+        }
+    }
+
+    setup_input();
+    setup_output();
+    const size_t unit = unit_size();
+    const size_t batch_size = (kSegmentSize + unit - 1) / unit * unit * workers_count;
+    const size_t out_capacity = output_length(batch_size);
+    batch_t batches[2] = {0};
+    for (int i = 0; i < 2; ++i) {
+        if (input.mode == kReadInput) {
+            batches[i].in_buffer = malloc(batch_size);
+            CHECK_ON_VALUE(batches[i].in_buffer, NULL, "malloc");
+        }
+        if (output.mode == kWrittenOutput) {
+            batches[i].out_buffer = malloc(out_capacity);
+            CHECK_ON_VALUE(batches[i].out_buffer, NULL, "malloc");
+        }
+    }
+
+    // other outputs are private until the batch is put, after the tags
+    if (options.mode == kGcmMode && !options.encrypt && output.mode == kMappedOutput) {
+        for (int i = 0; i < workers_count; ++i) {
+            workers[i].scratch = malloc(kSegmentSize);
+            CHECK_ON_VALUE(workers[i].scratch, NULL, "malloc");
+        }
+    }
+
+    pthread_barrier_init(&barrier, NULL, workers_count + 1);
+    for (int i = 0; i < workers_count; ++i) {
+        const int error = pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+        if (error) {
+            errno = error;
+            perror("pthread_create");
+            exit(errno);
+        }
+    }
+
+    const bool unpad = options.mode == kCbcMode && !options.encrypt;
+    memcpy(batches[0].iv, stream_iv, kBlockSize);
+    take_batch(&batches[0], batch_size, out_capacity);
+    batch_t* previous = NULL;
+    size_t total = 0;
+    for (int turn = 0; batches[turn].length > 0; turn ^= 1) {
+        batch_t* batch = &batches[turn];
+        batch_t* next = &batches[turn ^ 1];
+        if (unpad && batch->length % kBlockSize != 0) {
+            // as EVP_DecryptFinal_ex reports a truncated input
+            fail("EVP_DecryptFinal_ex: wrong final block length");
+        }
+
+        current_batch = batch;
+        pthread_barrier_wait(&barrier);
+        // meanwhile: flush the previous batch, then read the next one into
+        // its buffers, the last block of this batch chains them
+        if (previous != NULL) {
+            put_batch(previous, out_capacity);
+        }
+        if (unpad) {
+            memcpy(next->iv, batch->in + batch->length - kBlockSize, kBlockSize);
+        }
+        next->length =
+            batch->length == batch_size ? take_batch(next, batch_size, out_capacity) : 0;
+        pthread_barrier_wait(&barrier);
+
+        for (int i = 0; i < workers_count; ++i) {
+            if (workers[i].error != NULL) {
+                fail(workers[i].error);
+            }
+        }
+        if (unpad && next->length == 0) {
+            const ssize_t length = unpadded_length(batch->out, batch->out_length);
+            if (length == -1) {
+                fail("EVP_DecryptFinal_ex: bad decrypt");
+            }
+            batch->out_length = length;
+        }
+        total += batch->out_length;
+        previous = batch;
+    }
+    if (previous != NULL) {
+        put_batch(previous, out_capacity);
+    }
+
+    unsigned char last[kBlockSize + kTagSize];
+    int last_length = 0;
+    if (unpad && previous == NULL) {
+        fail("EVP_DecryptFinal_ex: bad decrypt");
+    } else if (options.mode == kCbcMode && options.encrypt) {
+        CHECK_ON_VALUE(EVP_CipherFinal_ex(workers[0].context, last, &last_length),
+                       0, "EVP_CipherFinal_ex");
+    } else if (options.mode == kGcmMode && input.offset % unit == 0) {
+        // a whole record is never the last one
+        if (!options.encrypt) {
+            fail("truncated");
+        }
+        CHECK_ON_VALUE(gcm_record(workers[0].context, true, stream_iv, input.offset / unit, true,
+                                  NULL, 0, last),
+                       false, "EVP_CipherFinal_ex");
+        last_length = kTagSize;
+    }
+    put_bytes(last, last_length);
+    finish_output(total + last_length);
+
+    stopping = true;
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < workers_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        EVP_CIPHER_CTX_free(workers[i].context);
+        free(workers[i].scratch);
+    }
+    pthread_barrier_destroy(&barrier);
+    for (int i = 0; i < 2; ++i) {
+        free(batches[i].in_buffer);
+        free(batches[i].out_buffer);
+    }
+    if (input.mode == kMappedInput) {
+        munmap((void*)input.mapping, input.mapping_length);
+    }
+}
+
+// Decrypts the GCM records of a file, returns an error message or NULL.
+static const char* decrypt_gcm_file(file_worker_t* worker, const unsigned char* iv, int input_fd,
+                                    int output_fd, size_t* length) {
+    const size_t unit = kSegmentSize + kTagSize;
+    for (uint64_t index = 0;; ++index) {
+        const ssize_t read_result = read_full(input_fd, worker->ciphered, unit);
+        if (read_result == -1) {
+            return strerror(errno);
+        }
+        const bool last = (size_t)read_result < unit;
+        if (last && read_result < kTagSize) {
+            return "truncated";
+        }
+        if (!gcm_record(worker->context, false, iv, index, last, worker->ciphered, read_result,
+                        worker->deciphered)) {
+            return "bad tag";
+        }
+        if (write_full(output_fd, worker->deciphered, read_result - kTagSize) == -1) {
+            return strerror(errno);
+        }
+        *length += read_result - kTagSize;
+        if (last) {
+            return NULL;
+        }
+    }
+}
+
+// Decrypts one file of the list, returns an error message or NULL.
+static const char* decrypt_file(file_worker_t* worker, const file_pair_t* pair, size_t* length) {
+    const char* error = NULL;
+    int output_fd = -1;
+    char* temporary_path = NULL;
+    const int input_fd = open(pair->input, O_RDONLY | O_CLOEXEC);
+    if (input_fd == -1) {
+        return strerror(errno);
+    }
+    // "Salted__" and the salt
+    unsigned char header[8 + kSaltSize];
+    const ssize_t header_length = read_full(input_fd, header, sizeof(header));
+    if (header_length != sizeof(header)) {
+        error = header_length == -1 ? strerror(errno) : "no salt";
+        goto out;
+    }
+    unsigned char key[kKeySize];
+    unsigned char iv[kBlockSize];
+    derive_key(header + 8, key, iv);
+    // the cipher is set once per context, then only the key and the IV
+    if (!EVP_DecryptInit_ex(worker->context, NULL, NULL, key,
+                            options.mode == kGcmMode ? NULL : iv)) {
+        error = "EVP_DecryptInit_ex";
+        goto out;
+    }
+
+    // a temporary file next to the output is renamed over it only once the
+    // whole file is decrypted, a failed file leaves nothing behind
+    if (asprintf(&temporary_path, "%s.XXXXXX", pair->output) == -1) {
+        temporary_path = NULL;
+        error = strerror(errno);
+        goto out;
+    }
+    output_fd = mkostemp(temporary_path, O_CLOEXEC);
+    if (output_fd == -1 || fchmod(output_fd, output_file_mode) == -1) {
+        error = strerror(errno);
+        goto out;
+    }
+    *length = 0;
+    if (options.mode == kGcmMode) {
+        error = decrypt_gcm_file(worker, iv, input_fd, output_fd, length);
+        goto out;
+    }
+    ssize_t read_result;
+    int write_result;
+    while ((read_result = read_full(input_fd, worker->ciphered, kSegmentSize)) > 0) {
+        if (!EVP_DecryptUpdate(worker->context, worker->deciphered, &write_result,
+                               worker->ciphered, read_result)) {
+            error = "EVP_DecryptUpdate";
+            goto out;
+        }
+        if (write_full(output_fd, worker->deciphered, write_result) == -1) {
+            error = strerror(errno);
+            goto out;
+        }
+        *length += write_result;
+    }
+    if (read_result == -1) {
+        error = strerror(errno);
+        goto out;
+    }
+    if (!EVP_DecryptFinal_ex(worker->context, worker->deciphered, &write_result)) {
+        error = "bad decrypt";
+        goto out;
+    }
+    if (write_full(output_fd, worker->deciphered, write_result) == -1) {
+        error = strerror(errno);
+        goto out;
+    }
+    *length += write_result;
 
+out:
+    close(input_fd);
+    if (output_fd != -1) {
+        if (close(output_fd) == -1 && error == NULL) {
+            error = strerror(errno);
+        }
+        if (error == NULL && rename(temporary_path, pair->output) == -1) {
+            error = strerror(errno);
+        }
+        if (error != NULL) {
+            unlink(temporary_path);
+        }
+    }
+    free(temporary_path);
+    return error;
+}
+
+static void* file_worker_routine(void* argument) {
+    file_worker_t* worker = argument;
+    size_t index;
+    while ((index = atomic_fetch_add(&next_file_pair, 1)) < file_pairs_count) {
+        const file_pair_t* pair = &file_pairs[index];
+        const double start = now_seconds();
+        size_t length = 0;
+        const char* error = decrypt_file(worker, pair, &length);
+        const double seconds = now_seconds() - start;
+        const size_t finished = atomic_fetch_add(&finished_files, 1) + 1;
+        if (error != NULL) {
+            atomic_fetch_add(&failed_files, 1);
+            fprintf(stderr, "[%zu/%zu] %s: %s\n", finished, file_pairs_count, pair->input, error);
+            continue;
+        }
+        atomic_fetch_add(&deciphered_bytes, length);
+        fprintf(stderr, "[%zu/%zu] %s -> %s: %zu bytes in %.3f ms, %.1f MB/s\n",
+                finished, file_pairs_count, pair->input, pair->output, length,
+                seconds * 1e3, seconds > 0 ? length / seconds / 1e6 : 0.0);
+    }
+    return NULL;
+}
+
+// Reads "INPUT OUTPUT" lines, empty ones and ones starting with '#' are
+// skipped.
+static void read_file_pairs(const char* path) {
+    FILE* list = fopen(path, "r");
+    CHECK_ON_VALUE(list, NULL, "fopen");
+    size_t capacity = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, list) != -1) {
+        char* input;
+        char* output;
+        if (line[0] == '#' || sscanf(line, "%ms %ms", &input, &output) != 2) {
+            continue;
+        }
+        if (file_pairs_count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            file_pairs = realloc(file_pairs, capacity * sizeof(file_pair_t));
+            CHECK_ON_VALUE(file_pairs, NULL, "realloc");
+        }
+        file_pairs[file_pairs_count++] = (file_pair_t){input, output};
+    }
+    free(line);
+    fclose(list);
+}
+
+// Decrypts the files of a list with a pool of workers_count threads.
+static int decrypt_files(const char* list_path) {
+    read_file_pairs(list_path);
+    if ((size_t)workers_count > file_pairs_count && file_pairs_count > 0) {
+        workers_count = file_pairs_count;
+    }
+
+    const mode_t mask = umask(0);
+    umask(mask);
+    output_file_mode = 0644 & ~mask;
+
+    const double start = now_seconds();
+    file_worker_t workers[kMaxThreads];
+    for (int i = 0; i < workers_count; ++i) {
+        workers[i].context = EVP_CIPHER_CTX_new();
+        CHECK_ON_VALUE(workers[i].context, NULL, "new");
+        CHECK_ON_VALUE(EVP_DecryptInit_ex(workers[i].context, cipher_of(options.mode), NULL,
+                                          NULL, NULL),
+                       0, "EVP_DecryptInit_ex");
+        workers[i].ciphered = malloc(kSegmentSize + kTagSize);
+        // EVP_DecryptUpdate may write a block more than it is given
+        workers[i].deciphered = malloc(kSegmentSize + kBlockSize);
+        CHECK_ON_VALUE(workers[i].ciphered, NULL, "malloc");
+        CHECK_ON_VALUE(workers[i].deciphered, NULL, "malloc");
+        const int error = pthread_create(&workers[i].thread, NULL, file_worker_routine, &workers[i]);
+        if (error) {
+            errno = error;
+            perror("pthread_create");
+            exit(errno);
+        }
+    }
+    for (int i = 0; i < workers_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        EVP_CIPHER_CTX_free(workers[i].context);
+        free(workers[i].ciphered);
+        free(workers[i].deciphered);
+    }
+
+    const double seconds = now_seconds() - start;
+    fprintf(stderr, "%zu files, %zu failed, %zu bytes in %.3f s, %.1f MB/s, %.0f files/s\n",
+            file_pairs_count, (size_t)failed_files, (size_t)deciphered_bytes, seconds,
+            deciphered_bytes / seconds / 1e6, file_pairs_count / seconds);
+    for (size_t i = 0; i < file_pairs_count; ++i) {
+        free(file_pairs[i].input);
+        free(file_pairs[i].output);
+    }
+    free(file_pairs);
+    return failed_files == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs the cipher over its share of the data in buffer_size calls, every
+// thread with its own context, as the workers do.
+static void* benchmark_routine(void* argument) {
+    benchmark_thread_t* run = argument;
+    static const unsigned char key[kKeySize];
+    static const unsigned char iv[kBlockSize];
     EVP_CIPHER_CTX* context = EVP_CIPHER_CTX_new();
     CHECK_ON_VALUE(context, NULL, "new");
+    CHECK_ON_VALUE(EVP_CipherInit_ex(context, cipher_of(run->mode), NULL, key, iv, run->encrypt),
+                   0, "EVP_CipherInit_ex");
+    EVP_CIPHER_CTX_set_padding(context, 0);
+    unsigned char* out = malloc(run->buffer_size + kTagSize);
+    CHECK_ON_VALUE(out, NULL, "malloc");
 
-    unsigned char salt[8];
-    CHECK_ON_VALUE(read(STDIN_FILENO, salt, 8), -1, "Salted__");
-    CHECK_ON_VALUE(read(STDIN_FILENO, salt, 8), -1, "Salt");
-
-    // For AES-256 the key size must be 256 bits or 32 bytes.
-    // The old school modes such as CBC and CFB however simply require an IV of the same size as the block size.
-    // The block size of AES is 16 bytes, whatever the key size.
-    const int key_length = EVP_CIPHER_key_length(EVP_aes_256_cbc()); // == 32
-    const int iv_length = EVP_CIPHER_iv_length(EVP_aes_256_cbc()); // == 16
-    const int block_size = EVP_CIPHER_block_size(EVP_aes_256_cbc()); // == 16
-
-    unsigned char* key = malloc(key_length * sizeof(unsigned char));
-    unsigned char* iv = malloc(iv_length* sizeof(unsigned char));
-    CHECK_ON_VALUE(key, NULL, "malloc");
-    CHECK_ON_VALUE(iv, NULL, "malloc");
-
-    // Генерация ключа и начального вектора из
-    // пароля произвольной длины и 8-байтной соли
-    EVP_BytesToKey(
-        EVP_aes_256_cbc(),    // алгоритм шифрования
-        EVP_sha256(),         // алгоритм хеширования пароля
-        salt,                 // соль
-        password, strlen(password), // пароль
-        1,                    // количество итераций хеширования
-        key,          // результат: ключ нужной длины
-        iv            // результат: начальный вектор нужной длины
-    );
+    int written;
+    uint64_t index = 0;
+    for (size_t offset = 0; offset + run->buffer_size <= run->length;
+         offset += run->buffer_size, ++index) {
+        if (run->mode == kGcmMode) {
+            // the tags of random data do not match, the work is the same
+            gcm_record(context, run->encrypt, iv, index, false, run->data + offset,
+                       run->buffer_size, out);
+        } else {
+            EVP_CipherUpdate(context, out, &written, run->data + offset, run->buffer_size);
+        }
+    }
+    free(out);
+    EVP_CIPHER_CTX_free(context);
+    return NULL;
+}
 
+// MB/s of the original loop: read, EVP_DecryptUpdate and write by 256
+// bytes, from a memory file to /dev/null.
+static double benchmark_loop(const unsigned char* data, size_t length) {
+    static const unsigned char key[kKeySize];
+    static const unsigned char iv[kBlockSize];
+    const int input_fd = memfd_create("benchmark", MFD_CLOEXEC);
+    const int output_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    CHECK_ON_VALUE(input_fd, -1, "memfd_create");
+    CHECK_ON_VALUE(output_fd, -1, "open");
+    CHECK_ON_VALUE(write_full(input_fd, data, length), -1, "write");
+    lseek(input_fd, 0, SEEK_SET);
+    EVP_CIPHER_CTX* context = EVP_CIPHER_CTX_new();
+    CHECK_ON_VALUE(context, NULL, "new");
     CHECK_ON_VALUE(EVP_DecryptInit_ex(context, EVP_aes_256_cbc(), NULL, key, iv),
                    0, "EVP_DecryptInit_ex");
-    unsigned char ciphered_buffer[kMaxSize];
-    // buffer out passed to EVP_DecryptUpdate() should have sufficient room for (inl + cipher_block_size) bytes
-    unsigned char deciphered_buffer[kMaxSize + block_size];
+    EVP_CIPHER_CTX_set_padding(context, 0);
 
+    unsigned char ciphered_buffer[256];
+    unsigned char deciphered_buffer[256 + kBlockSize];
     int read_result;
     int write_result;
-    while ((read_result = read(STDIN_FILENO, ciphered_buffer, sizeof(ciphered_buffer))) > 0) {
-        CHECK_ON_VALUE(EVP_DecryptUpdate(context, deciphered_buffer, &write_result, ciphered_buffer, read_result),
-                       0, "EVP_DecryptUpdate");
-        CHECK_ON_VALUE(write(STDOUT_FILENO, deciphered_buffer, write_result), -1, "write");
+    const double start = now_seconds();
+    while ((read_result = read(input_fd, ciphered_buffer, sizeof(ciphered_buffer))) > 0) {
+        EVP_DecryptUpdate(context, deciphered_buffer, &write_result, ciphered_buffer, read_result);
+        CHECK_ON_VALUE(write(output_fd, deciphered_buffer, write_result), -1, "write");
     }
-    CHECK_ON_VALUE(read_result, -1, "read");
-    CHECK_ON_VALUE(EVP_DecryptFinal_ex(context, deciphered_buffer, &write_result),
-                   0, "EVP_DecryptFinal_ex");
-    CHECK_ON_VALUE(write(STDOUT_FILENO, deciphered_buffer, write_result), -1, "write");
-
+    const double seconds = now_seconds() - start;
     EVP_CIPHER_CTX_free(context);
-    free(key);
-    free(iv);
+    close(input_fd);
+    close(output_fd);
+    return length / seconds / 1e6;
+}
+
+// MB/s of every mode, direction, buffer size and thread count over
+// options.benchmark_size bytes in memory, without the I/O, compared with
+// the original loop.
+static void run_benchmark(void) {
+    static const struct {
+        const char* name;
+        enum cipher_mode mode;
+        bool encrypt;
+    } kCiphers[] = {
+        {"cbc-dec", kCbcMode, false},
+        {"cbc-enc", kCbcMode, true},
+        {"ctr", kCtrMode, true},
+        {"gcm-enc", kGcmMode, true},
+        {"gcm-dec", kGcmMode, false},
+    };
+    static const size_t kBufferSizes[] = {256, 4096, 64 << 10, 1 << 20};
+
+    unsigned char* data = malloc(options.benchmark_size);
+    CHECK_ON_VALUE(data, NULL, "malloc");
+    CHECK_ON_VALUE((RAND_bytes(data, options.benchmark_size) == 1), false, "RAND_bytes");
+
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads > kMaxThreads) {
+        max_threads = kMaxThreads;
+    }
+    printf("%zu bytes per run, cbc-enc threads run separate streams\n\n", options.benchmark_size);
+    printf("%-8s %8s %8s %10s %8s\n", "mode", "buffer", "threads", "MB/s", "vs loop");
+    const double baseline = benchmark_loop(data, options.benchmark_size);
+    printf("%-8s %8d %8d %10.1f %8.2f\n", "loop", 256, 1, baseline, 1.0);
+    for (size_t c = 0; c < sizeof(kCiphers) / sizeof(kCiphers[0]); ++c) {
+        for (size_t b = 0; b < sizeof(kBufferSizes) / sizeof(kBufferSizes[0]); ++b) {
+            for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+                benchmark_thread_t runs[kMaxThreads];
+                const size_t share =
+                    options.benchmark_size / threads / kBufferSizes[b] * kBufferSizes[b];
+                const double start = now_seconds();
+                for (int i = 0; i < threads; ++i) {
+                    runs[i] = (benchmark_thread_t){
+                        .mode = kCiphers[c].mode,
+                        .encrypt = kCiphers[c].encrypt,
+                        .buffer_size = kBufferSizes[b],
+                        .data = data + share * i,
+                        .length = share,
+                    };
+                    const int error = pthread_create(&runs[i].thread, NULL, benchmark_routine, &runs[i]);
+                    if (error) {
+                        errno = error;
+                        perror("pthread_create");
+                        exit(errno);
+                    }
+                }
+                for (int i = 0; i < threads; ++i) {
+                    pthread_join(runs[i].thread, NULL);
+                }
+                const double speed = share * threads / (now_seconds() - start) / 1e6;
+                printf("%-8s %8zu %8d %10.1f %8.2f\n", kCiphers[c].name, kBufferSizes[b], threads,
+                       speed, speed / baseline);
+                if (threads == max_threads) {
+                    break;
+                }
+            }
+        }
+    }
+    free(data);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [options] PASSWORD [THREADS]\n"
+            "       %s --benchmark[=SIZE]\n"
+            "  -e, --encrypt        encrypt stdin instead of decrypting it\n"
+            "  -m, --mode MODE      cbc (default, as openssl enc), ctr or gcm\n"
+            "  -i, --pbkdf2 ITER    derive the key with PBKDF2-HMAC-SHA256 and ITER\n"
+            "                       iterations, as openssl enc -pbkdf2 -iter ITER\n"
+            "  -b, --batch LIST     decrypt the \"INPUT OUTPUT\" lines of LIST\n"
+            "  -B, --benchmark[=SIZE]\n"
+            "                       MB/s per mode, buffer size and thread count on SIZE\n"
+            "                       bytes in memory (64m), against the 256-byte loop\n",
+            program, program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const struct option long_options[] = {
+        {"encrypt", no_argument, NULL, 'e'},
+        {"mode", required_argument, NULL, 'm'},
+        {"pbkdf2", required_argument, NULL, 'i'},
+        {"batch", required_argument, NULL, 'b'},
+        {"benchmark", optional_argument, NULL, 'B'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "em:i:b:B::", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'e':
+            options.encrypt = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "cbc") == 0) {
+                options.mode = kCbcMode;
+            } else if (strcmp(optarg, "ctr") == 0) {
+                options.mode = kCtrMode;
+            } else if (strcmp(optarg, "gcm") == 0) {
+                options.mode = kGcmMode;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            options.iterations = atoi(optarg);
+            if (options.iterations < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            options.batch_list = optarg;
+            break;
+        case 'B':
+            options.benchmark_size = optarg != NULL ? parse_size(optarg) : kDefaultBenchmarkSize;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // For AES-256 the key size must be 256 bits or 32 bytes.
+    // The old school modes such as CBC and CFB however simply require an IV of the same size as the block size.
+    // The block size of AES is 16 bytes, whatever the key size.
+    assert(EVP_CIPHER_key_length(EVP_aes_256_cbc()) == kKeySize);
+    assert(EVP_CIPHER_iv_length(EVP_aes_256_cbc()) == kBlockSize);
+    assert(EVP_CIPHER_block_size(EVP_aes_256_cbc()) == kBlockSize);
+
+    if (options.benchmark_size != 0) {
+        run_benchmark();
+        exit(EXIT_SUCCESS);
+    }
+    if (optind == argc || argc - optind > 2 || (options.encrypt && options.batch_list)) {
+        usage(argv[0]);
+    }
+    password = (const unsigned char*)argv[optind];
+    const char* threads = argv[optind + 1];
+
+    workers_count = threads != NULL ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers_count < 1) {
+        workers_count = 1;
+    }
+    if (workers_count > kMaxThreads) {
+        workers_count = kMaxThreads;
+    }
+
+    if (options.batch_list != NULL) {
+        exit(decrypt_files(options.batch_list));
+    }
+    process_stream();
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}